@@ -0,0 +1,354 @@
+#pragma once
+#include "Msg.h"
+#include "HugePages.h"
+#include <mutex>
+#include <new>
+#include <vector>
+#include <memory>
+#include <algorithm>
+
+//Fixed block of message slots; queues link these instead of growing one contiguous buffer.
+struct MsgChunk
+{
+	enum
+	{
+		CAPACITY = 255
+	};
+	MsgChunk() : next(nullptr) {}
+	MsgChunk *next;
+	BaseMsgPtr slots[CAPACITY];
+};
+
+class ChunkPool;
+using ChunkPoolPtr = std::shared_ptr<ChunkPool>;
+
+//Free chunks shared by all queues. Once more than high_watermark chunks are cached the pool
+//frees them back to the allocator down to low_watermark, so a burst does not pin its peak forever.
+//Chunks reserved on huge pages live in arenas that are kept for the pool's lifetime and handed
+//out before heap chunks.
+class ChunkPool
+{
+public:
+	static ChunkPoolPtr getInstance()
+	{
+		static ChunkPoolPtr instance_ptr(new ChunkPool());
+		return instance_ptr;
+	}
+
+	explicit ChunkPool(size_t _low_watermark = 256, size_t _high_watermark = 1024) : free_list(nullptr),
+																					 arena_free(nullptr),
+																					 cached_count(0),
+																					 low_watermark(_low_watermark),
+																					 high_watermark(_high_watermark)
+	{
+	}
+	~ChunkPool()
+	{
+		trim(0);
+		for (size_t i = 0; i < arenas.size(); ++i)
+		{
+			for (size_t c = 0; c < arenas[i].chunks; ++c)
+				arenas[i].base[c].~MsgChunk();
+			hugepage::unmap(arenas[i].base, arenas[i].chunks * sizeof(MsgChunk));
+		}
+	}
+
+	MsgChunk *acquire()
+	{
+		{
+			std::lock_guard<std::mutex> lg(mtx);
+			if (arena_free)
+			{
+				MsgChunk *chunk = arena_free;
+				arena_free = chunk->next;
+				chunk->next = nullptr;
+				return chunk;
+			}
+			if (free_list)
+			{
+				MsgChunk *chunk = free_list;
+				free_list = chunk->next;
+				chunk->next = nullptr;
+				--cached_count;
+				return chunk;
+			}
+		}
+		return new MsgChunk();
+	}
+
+	//slots must already be empty
+	void release(MsgChunk *chunk)
+	{
+		std::lock_guard<std::mutex> lg(mtx);
+		if (inArena(chunk))
+		{
+			chunk->next = arena_free;
+			arena_free = chunk;
+			return;
+		}
+		chunk->next = free_list;
+		free_list = chunk;
+		if (++cached_count > high_watermark)
+			trimLocked(low_watermark);
+	}
+
+	void setWatermarks(size_t _low_watermark, size_t _high_watermark)
+	{
+		std::lock_guard<std::mutex> lg(mtx);
+		low_watermark = _low_watermark;
+		high_watermark = (std::max)(_low_watermark, _high_watermark);
+		if (cached_count > high_watermark)
+			trimLocked(low_watermark);
+	}
+
+	//preallocate chunks into the cache, raising the high watermark so they are kept; with
+	//huge_pages they are carved from one huge-page mapping instead (heap chunks if that fails)
+	void reserve(size_t chunks, bool huge_pages = false)
+	{
+		if (huge_pages && chunks && reserveArena(chunks))
+			return;
+		std::lock_guard<std::mutex> lg(mtx);
+		high_watermark = (std::max)(high_watermark, cached_count + chunks);
+		for (size_t i = 0; i < chunks; ++i)
+		{
+			MsgChunk *chunk = new MsgChunk();
+			chunk->next = free_list;
+			free_list = chunk;
+			++cached_count;
+		}
+	}
+
+	//free cached chunks until at most keep remain
+	void trim(size_t keep = 0)
+	{
+		std::lock_guard<std::mutex> lg(mtx);
+		trimLocked(keep);
+	}
+
+	size_t cached()
+	{
+		std::lock_guard<std::mutex> lg(mtx);
+		return cached_count;
+	}
+
+	//free chunks left in huge-page arenas
+	size_t arenaAvailable()
+	{
+		std::lock_guard<std::mutex> lg(mtx);
+		size_t n = 0;
+		for (MsgChunk *chunk = arena_free; chunk; chunk = chunk->next)
+			++n;
+		return n;
+	}
+
+private:
+	struct Arena
+	{
+		MsgChunk *base;
+		size_t chunks;
+	};
+
+	bool reserveArena(size_t chunks)
+	{
+		MsgChunk *base = (MsgChunk *)hugepage::map(chunks * sizeof(MsgChunk));
+		if (!base)
+			return false;
+		//the mapping is rounded up to whole huge pages; use all of it
+		chunks = hugepage::roundUp(chunks * sizeof(MsgChunk)) / sizeof(MsgChunk);
+		std::lock_guard<std::mutex> lg(mtx);
+		Arena arena = {base, chunks};
+		arenas.push_back(arena);
+		for (size_t c = chunks; c-- > 0;)
+		{
+			MsgChunk *chunk = new (base + c) MsgChunk();
+			chunk->next = arena_free;
+			arena_free = chunk;
+		}
+		return true;
+	}
+
+	bool inArena(MsgChunk *chunk) const
+	{
+		for (size_t i = 0; i < arenas.size(); ++i)
+		{
+			if (chunk >= arenas[i].base && chunk < arenas[i].base + arenas[i].chunks)
+				return true;
+		}
+		return false;
+	}
+
+	void trimLocked(size_t keep)
+	{
+		while (cached_count > keep)
+		{
+			MsgChunk *chunk = free_list;
+			free_list = chunk->next;
+			delete chunk;
+			--cached_count;
+		}
+	}
+
+private:
+	std::mutex mtx;
+	MsgChunk *free_list;
+	MsgChunk *arena_free;
+	std::vector<Arena> arenas;
+	size_t cached_count;
+	size_t low_watermark;
+	size_t high_watermark;
+};
+
+//FIFO of messages over a linked list of pooled chunks. Drained chunks beyond spare_limit go back
+//to the pool right away, so the queue's footprint follows its current length rather than its peak.
+class ChunkQueue
+{
+public:
+	explicit ChunkQueue(ChunkPoolPtr _pool = ChunkPool::getInstance(), size_t _spare_limit = 1) : pool(_pool),
+																								  head(nullptr),
+																								  tail(nullptr),
+																								  spares(nullptr),
+																								  head_idx(0),
+																								  tail_idx(0),
+																								  count(0),
+																								  spare_count(0),
+																								  spare_limit(_spare_limit)
+	{
+	}
+	~ChunkQueue()
+	{
+		clear();
+		setSpareLimit(0);
+	}
+	ChunkQueue(const ChunkQueue &) = delete;
+	ChunkQueue &operator=(const ChunkQueue &) = delete;
+
+	bool empty() const
+	{
+		return count == 0;
+	}
+
+	size_t size() const
+	{
+		return count;
+	}
+
+	BaseMsgPtr &front()
+	{
+		return head->slots[head_idx];
+	}
+
+	void push_back(const BaseMsgPtr &msg)
+	{
+		if (!tail || tail_idx == MsgChunk::CAPACITY)
+			grow();
+		tail->slots[tail_idx++] = msg;
+		++count;
+	}
+
+	void pop_front()
+	{
+		head->slots[head_idx++].reset();
+		--count;
+		if (head == tail && head_idx == tail_idx)
+		{
+			//drained: rewind in place and keep the last chunk
+			head_idx = tail_idx = 0;
+		}
+		else if (head_idx == MsgChunk::CAPACITY)
+		{
+			MsgChunk *done = head;
+			head = head->next;
+			head_idx = 0;
+			retire(done);
+		}
+	}
+
+	void clear()
+	{
+		while (!empty())
+			pop_front();
+		if (head)
+			retire(head);
+		head = tail = nullptr;
+		head_idx = tail_idx = 0;
+	}
+
+	//keep enough spare chunks locally that messages more can be queued without allocating;
+	//huge_pages first reserves them in the pool on huge pages
+	void reserve(size_t messages, bool huge_pages = false)
+	{
+		size_t free_slots = tail ? MsgChunk::CAPACITY - tail_idx : 0;
+		size_t chunks = messages > free_slots ? (messages - free_slots + MsgChunk::CAPACITY - 1) / MsgChunk::CAPACITY : 0;
+		if (huge_pages && chunks > spare_count)
+			pool->reserve(chunks - spare_count, true);
+		spare_limit = (std::max)(spare_limit, chunks);
+		while (spare_count < chunks)
+		{
+			MsgChunk *chunk = pool->acquire();
+			chunk->next = spares;
+			spares = chunk;
+			++spare_count;
+		}
+	}
+
+	//number of empty chunks kept locally for the next burst
+	void setSpareLimit(size_t _spare_limit)
+	{
+		spare_limit = _spare_limit;
+		while (spare_count > spare_limit)
+		{
+			MsgChunk *chunk = spares;
+			spares = chunk->next;
+			--spare_count;
+			pool->release(chunk);
+		}
+	}
+
+private:
+	void grow()
+	{
+		MsgChunk *chunk;
+		if (spares)
+		{
+			chunk = spares;
+			spares = chunk->next;
+			--spare_count;
+		}
+		else
+		{
+			chunk = pool->acquire();
+		}
+		chunk->next = nullptr;
+		if (tail)
+			tail->next = chunk;
+		else
+			head = chunk;
+		tail = chunk;
+		tail_idx = 0;
+	}
+
+	void retire(MsgChunk *chunk)
+	{
+		if (spare_count < spare_limit)
+		{
+			chunk->next = spares;
+			spares = chunk;
+			++spare_count;
+		}
+		else
+		{
+			pool->release(chunk);
+		}
+	}
+
+private:
+	ChunkPoolPtr pool;
+	MsgChunk *head;
+	MsgChunk *tail;
+	MsgChunk *spares;
+	size_t head_idx;
+	size_t tail_idx;
+	size_t count;
+	size_t spare_count;
+	size_t spare_limit;
+};
@@ -0,0 +1,92 @@
+#pragma once
+#include <cstdint>
+#include <cmath>
+
+//CoDel active queue management (RFC 8289) over message sojourn times. Once the sojourn has
+//stayed above target for a whole interval the queue drops (or marks) a message, then drops
+//again at intervals shrinking with 1/sqrt(drops) until the sojourn falls back under target.
+//A standing queue is drained this way while short bursts pass untouched. Not thread safe;
+//the owning queue calls it under its lock.
+class CoDel
+{
+public:
+	explicit CoDel(int64_t _target_us = 0, int64_t _interval_us = 100000) : target_us(_target_us),
+																			interval_us(_interval_us),
+																			first_above(0),
+																			drop_next(0),
+																			count(0),
+																			last_count(0),
+																			dropping(false)
+	{
+	}
+
+	//target_us 0 disables
+	void configure(int64_t _target_us, int64_t _interval_us)
+	{
+		*this = CoDel(_target_us, _interval_us);
+	}
+
+	bool enabled() const
+	{
+		return target_us > 0;
+	}
+
+	//called for every dequeued message; true when it should be dropped or marked. The last
+	//message in the queue is never dropped.
+	bool onDequeue(int64_t sojourn_us, int64_t now_us, bool empty_after)
+	{
+		bool ok_to_drop = okToDrop(sojourn_us, now_us, empty_after);
+		if (dropping)
+		{
+			if (!ok_to_drop)
+			{
+				dropping = false;
+				return false;
+			}
+			if (now_us < drop_next)
+				return false;
+			++count;
+			drop_next = controlLaw(drop_next);
+			return true;
+		}
+		if (!ok_to_drop)
+			return false;
+		dropping = true;
+		//re-entering soon after the last episode resumes close to its drop rate
+		uint32_t delta = count - last_count;
+		count = delta > 1 && now_us - drop_next < 16 * interval_us ? delta : 1;
+		last_count = count;
+		drop_next = controlLaw(now_us);
+		return true;
+	}
+
+private:
+	bool okToDrop(int64_t sojourn_us, int64_t now_us, bool empty_after)
+	{
+		if (sojourn_us < target_us || empty_after)
+		{
+			first_above = 0;
+			return false;
+		}
+		if (!first_above)
+		{
+			first_above = now_us + interval_us;
+			return false;
+		}
+		return now_us >= first_above;
+	}
+
+	int64_t controlLaw(int64_t t) const
+	{
+		return t + (int64_t)(interval_us / std::sqrt((double)count));
+	}
+
+private:
+	int64_t target_us;
+	int64_t interval_us;
+	int64_t first_above;
+	int64_t drop_next;
+	uint32_t count;
+	uint32_t last_count;
+	bool dropping;
+};
@@ -0,0 +1,487 @@
+#pragma once
+#include "ThreadSafeMsgQueue.h"
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <type_traits>
+#include <algorithm>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+//Recording format for numeric topics. Samples are grouped in blocks; each block stores the
+//timestamp column as zigzag deltas and the value column as zigzag deltas (integers) or XOR
+//with the previous value's bits (floating point), both bit-packed at the block's widest
+//value. An index of block time ranges at the end of the file makes seeking O(log blocks),
+//and every column is 8-byte aligned so a memory-mapped file can be scanned in place.
+//Samples are stored in arrival order, which need not be timestamp order (a topic dispatches
+//by priority), so the index keeps each block's smallest and largest timestamp.
+//
+//  FileHeader | Block* | IndexEntry[blocks] | Trailer
+//  Block = BlockHeader | uint64 timestamp words | uint64 value words
+namespace columnar
+{
+	struct FileHeader
+	{
+		char magic[8];
+		uint32_t value_tag;
+		uint32_t block_size;
+	};
+
+	struct BlockHeader
+	{
+		uint32_t count;
+		uint8_t ts_width;
+		uint8_t value_width;
+		uint16_t reserved;
+		int64_t t_first;
+		int64_t t_last;
+		uint64_t value_first;
+	};
+
+	struct IndexEntry
+	{
+		int64_t t_min;
+		int64_t t_max;
+		uint64_t offset;
+		uint64_t count;
+	};
+
+	struct Trailer
+	{
+		uint64_t index_offset;
+		uint64_t blocks;
+		char magic[8];
+	};
+
+	static const char MAGIC[8] = {'M', 'Q', 'C', 'O', 'L', '0', '1', 0};
+
+	//value size in the low byte, 0x100 for floating point
+	template <typename T>
+	uint32_t valueTag()
+	{
+		return (uint32_t)sizeof(T) | (std::is_floating_point<T>::value ? 0x100 : 0);
+	}
+
+	inline uint64_t zigzag(int64_t v)
+	{
+		return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+	}
+
+	inline int64_t unzigzag(uint64_t v)
+	{
+		return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+	}
+
+	inline uint8_t bitWidth(uint64_t v)
+	{
+		uint8_t w = 0;
+		while (v)
+		{
+			++w;
+			v >>= 1;
+		}
+		return w;
+	}
+
+	inline size_t packedWords(size_t count, uint8_t width)
+	{
+		return (count * width + 63) / 64;
+	}
+
+	inline void pack(const uint64_t *in, size_t count, uint8_t width, uint64_t *out)
+	{
+		memset(out, 0, packedWords(count, width) * sizeof(uint64_t));
+		if (!width)
+			return;
+		for (size_t i = 0; i < count; ++i)
+		{
+			size_t bit = i * width;
+			out[bit >> 6] |= in[i] << (bit & 63);
+			if ((bit & 63) + width > 64)
+				out[(bit >> 6) + 1] |= in[i] >> (64 - (bit & 63));
+		}
+	}
+
+	//branch-light and independent per element so the compiler can vectorize it
+	inline void unpack(const uint64_t *in, size_t count, uint8_t width, uint64_t *out)
+	{
+		if (!width)
+		{
+			memset(out, 0, count * sizeof(uint64_t));
+			return;
+		}
+		uint64_t mask = width == 64 ? ~0ull : ((1ull << width) - 1);
+		for (size_t i = 0; i < count; ++i)
+		{
+			size_t bit = i * width;
+			size_t word = bit >> 6;
+			unsigned shift = bit & 63;
+			uint64_t v = in[word] >> shift;
+			if (shift + width > 64)
+				v |= in[word + 1] << (64 - shift);
+			out[i] = v & mask;
+		}
+	}
+
+	template <typename T>
+	uint64_t toBits(T v, std::true_type)
+	{
+		if (sizeof(T) >= sizeof(double))
+		{
+			double d = (double)v;
+			uint64_t bits;
+			memcpy(&bits, &d, sizeof(bits));
+			return bits;
+		}
+		float f = (float)v;
+		uint32_t bits;
+		memcpy(&bits, &f, sizeof(bits));
+		return bits;
+	}
+
+	template <typename T>
+	uint64_t toBits(T v, std::false_type)
+	{
+		return (uint64_t)(int64_t)v;
+	}
+
+	template <typename T>
+	T fromBits(uint64_t bits, std::true_type)
+	{
+		if (sizeof(T) >= sizeof(double))
+		{
+			double d;
+			memcpy(&d, &bits, sizeof(d));
+			return (T)d;
+		}
+		float f;
+		uint32_t b = (uint32_t)bits;
+		memcpy(&f, &b, sizeof(f));
+		return (T)f;
+	}
+
+	template <typename T>
+	T fromBits(uint64_t bits, std::false_type)
+	{
+		return (T)(int64_t)bits;
+	}
+}
+
+template <typename T>
+class ColumnarWriter;
+template <typename T>
+using ColumnarWriterPtr = std::shared_ptr<ColumnarWriter<T> >;
+
+template <typename T>
+class ColumnarWriter
+{
+	static_assert(std::is_arithmetic<T>::value, "columnar recording needs a numeric payload");
+	typedef typename std::is_floating_point<T>::type IsFloat;
+
+public:
+	explicit ColumnarWriter(const std::string &path, uint32_t _block_size = 4096) : block_size(_block_size ? _block_size : 1),
+																					 offset(0)
+	{
+		file = fopen(path.c_str(), "wb");
+		if (!file)
+			return;
+		columnar::FileHeader header;
+		memcpy(header.magic, columnar::MAGIC, sizeof(header.magic));
+		header.value_tag = columnar::valueTag<T>();
+		header.block_size = block_size;
+		write(&header, sizeof(header));
+		timestamps.reserve(block_size);
+		values.reserve(block_size);
+	}
+	~ColumnarWriter()
+	{
+		close();
+	}
+
+	bool isOpen() const
+	{
+		return file != nullptr;
+	}
+
+	void append(int64_t timestamp, T value)
+	{
+		std::lock_guard<std::mutex> lg(mtx);
+		if (!file)
+			return;
+		timestamps.push_back(timestamp);
+		values.push_back(columnar::toBits(value, IsFloat()));
+		if (timestamps.size() == block_size)
+			flushBlock();
+	}
+
+	//writes the pending block and the index; the file is complete afterwards
+	void close()
+	{
+		std::lock_guard<std::mutex> lg(mtx);
+		if (!file)
+			return;
+		flushBlock();
+		columnar::Trailer trailer;
+		trailer.index_offset = offset;
+		trailer.blocks = index.size();
+		memcpy(trailer.magic, columnar::MAGIC, sizeof(trailer.magic));
+		if (!index.empty())
+			write(&index[0], index.size() * sizeof(columnar::IndexEntry));
+		write(&trailer, sizeof(trailer));
+		if (file)
+			fclose(file);
+		file = nullptr;
+	}
+
+private:
+	void flushBlock()
+	{
+		size_t count = timestamps.size();
+		if (!count)
+			return;
+		encoded.resize(count);
+
+		columnar::BlockHeader header;
+		header.count = (uint32_t)count;
+		header.reserved = 0;
+		header.t_first = timestamps.front();
+		header.t_last = timestamps.back();
+		header.value_first = values.front();
+
+		uint64_t all = 0;
+		encoded[0] = 0;
+		for (size_t i = 1; i < count; ++i)
+		{
+			encoded[i] = columnar::zigzag(timestamps[i] - timestamps[i - 1]);
+			all |= encoded[i];
+		}
+		header.ts_width = columnar::bitWidth(all);
+		std::vector<uint64_t> ts_words(columnar::packedWords(count, header.ts_width));
+		columnar::pack(&encoded[0], count, header.ts_width, ts_words.data());
+
+		all = 0;
+		for (size_t i = 1; i < count; ++i)
+		{
+			encoded[i] = IsFloat::value ? values[i] ^ values[i - 1] : columnar::zigzag((int64_t)(values[i] - values[i - 1]));
+			all |= encoded[i];
+		}
+		header.value_width = columnar::bitWidth(all);
+		std::vector<uint64_t> value_words(columnar::packedWords(count, header.value_width));
+		columnar::pack(&encoded[0], count, header.value_width, value_words.data());
+
+		columnar::IndexEntry entry;
+		entry.t_min = *std::min_element(timestamps.begin(), timestamps.end());
+		entry.t_max = *std::max_element(timestamps.begin(), timestamps.end());
+		entry.offset = offset;
+		entry.count = count;
+		index.push_back(entry);
+
+		write(&header, sizeof(header));
+		write(ts_words.data(), ts_words.size() * sizeof(uint64_t));
+		write(value_words.data(), value_words.size() * sizeof(uint64_t));
+		timestamps.clear();
+		values.clear();
+	}
+
+	void write(const void *data, size_t len)
+	{
+		if (!file)
+			return;
+		if (len && fwrite(data, 1, len, file) != len)
+		{
+			fclose(file);
+			file = nullptr;
+			return;
+		}
+		offset += len;
+	}
+
+private:
+	std::mutex mtx;
+	FILE *file;
+	uint32_t block_size;
+	uint64_t offset;
+	std::vector<int64_t> timestamps;
+	std::vector<uint64_t> values;
+	std::vector<uint64_t> encoded;
+	std::vector<columnar::IndexEntry> index;
+};
+
+template <typename T>
+class ColumnarReader;
+template <typename T>
+using ColumnarReaderPtr = std::shared_ptr<ColumnarReader<T> >;
+
+//Memory-maps a file written by ColumnarWriter<T>.
+template <typename T>
+class ColumnarReader
+{
+	static_assert(std::is_arithmetic<T>::value, "columnar recording needs a numeric payload");
+	typedef typename std::is_floating_point<T>::type IsFloat;
+
+public:
+	explicit ColumnarReader(const std::string &path) : base(nullptr), length(0), index(nullptr), block_count(0)
+	{
+		int fd = open(path.c_str(), O_RDONLY);
+		if (fd < 0)
+			return;
+		struct stat st;
+		if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(columnar::FileHeader) + sizeof(columnar::Trailer))
+		{
+			void *mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (mapped != MAP_FAILED)
+			{
+				base = (const char *)mapped;
+				length = st.st_size;
+			}
+		}
+		::close(fd);
+		if (base && !validate())
+		{
+			munmap((void *)base, length);
+			base = nullptr;
+		}
+	}
+	~ColumnarReader()
+	{
+		if (base)
+			munmap((void *)base, length);
+	}
+
+	bool isOpen() const
+	{
+		return base != nullptr;
+	}
+
+	size_t blocks() const
+	{
+		return block_count;
+	}
+
+	const columnar::IndexEntry &block(size_t i) const
+	{
+		return index[i];
+	}
+
+	//first block that may hold samples at or after timestamp; blocks() if none
+	size_t seek(int64_t timestamp) const
+	{
+		return std::lower_bound(max_before.begin(), max_before.end(), timestamp) - max_before.begin();
+	}
+
+	void readBlock(size_t i, std::vector<int64_t> &timestamps, std::vector<T> &values) const
+	{
+		const columnar::BlockHeader *header = (const columnar::BlockHeader *)(base + index[i].offset);
+		size_t count = header->count;
+		const uint64_t *ts_words = (const uint64_t *)(header + 1);
+		const uint64_t *value_words = ts_words + columnar::packedWords(count, header->ts_width);
+
+		decoded.resize(count);
+		timestamps.resize(count);
+		columnar::unpack(ts_words, count, header->ts_width, decoded.data());
+		int64_t t = header->t_first;
+		timestamps[0] = t;
+		for (size_t k = 1; k < count; ++k)
+		{
+			t += columnar::unzigzag(decoded[k]);
+			timestamps[k] = t;
+		}
+
+		values.resize(count);
+		columnar::unpack(value_words, count, header->value_width, decoded.data());
+		uint64_t v = header->value_first;
+		values[0] = columnar::fromBits<T>(v, IsFloat());
+		for (size_t k = 1; k < count; ++k)
+		{
+			v = IsFloat::value ? v ^ decoded[k] : (uint64_t)((int64_t)v + columnar::unzigzag(decoded[k]));
+			values[k] = columnar::fromBits<T>(v, IsFloat());
+		}
+	}
+
+	//calls f(timestamp, value) for every sample in [t_begin, t_end)
+	template <typename F>
+	void scan(int64_t t_begin, int64_t t_end, F f) const
+	{
+		std::vector<int64_t> timestamps;
+		std::vector<T> values;
+		for (size_t i = seek(t_begin); i < block_count && min_after[i] < t_end; ++i)
+		{
+			if (index[i].t_max < t_begin || index[i].t_min >= t_end)
+				continue;
+			readBlock(i, timestamps, values);
+			for (size_t k = 0; k < timestamps.size(); ++k)
+			{
+				if (timestamps[k] >= t_begin && timestamps[k] < t_end)
+					f(timestamps[k], values[k]);
+			}
+		}
+	}
+
+private:
+	bool validate()
+	{
+		const columnar::FileHeader *header = (const columnar::FileHeader *)base;
+		const columnar::Trailer *trailer = (const columnar::Trailer *)(base + length - sizeof(columnar::Trailer));
+		if (memcmp(header->magic, columnar::MAGIC, sizeof(columnar::MAGIC)) || memcmp(trailer->magic, columnar::MAGIC, sizeof(columnar::MAGIC)))
+			return false;
+		if (header->value_tag != columnar::valueTag<T>())
+			return false;
+		//blocks and index lie between the file header and the trailer, 8-byte aligned
+		size_t end = length - sizeof(columnar::Trailer);
+		if (trailer->index_offset < sizeof(columnar::FileHeader) || trailer->index_offset > end || trailer->index_offset % 8)
+			return false;
+		if (trailer->blocks != (end - trailer->index_offset) / sizeof(columnar::IndexEntry) ||
+			trailer->index_offset + trailer->blocks * sizeof(columnar::IndexEntry) != end)
+			return false;
+		index = (const columnar::IndexEntry *)(base + trailer->index_offset);
+		block_count = trailer->blocks;
+		for (size_t i = 0; i < block_count; ++i)
+		{
+			if (!validBlock(index[i], trailer->index_offset))
+				return false;
+		}
+		//running max of t_max and min of t_min still to come, so seek and scan can binary
+		//search and stop early although blocks are not sorted by time
+		max_before.resize(block_count);
+		min_after.resize(block_count);
+		for (size_t i = 0; i < block_count; ++i)
+			max_before[i] = i ? (std::max)(max_before[i - 1], index[i].t_max) : index[i].t_max;
+		for (size_t i = block_count; i-- > 0;)
+			min_after[i] = i + 1 < block_count ? (std::min)(min_after[i + 1], index[i].t_min) : index[i].t_min;
+		return true;
+	}
+
+	//entry's block lies before the index and its columns fit inside it
+	bool validBlock(const columnar::IndexEntry &entry, uint64_t index_offset) const
+	{
+		if (entry.offset < sizeof(columnar::FileHeader) || entry.offset % 8 || entry.offset > index_offset ||
+			index_offset - entry.offset < sizeof(columnar::BlockHeader))
+			return false;
+		const columnar::BlockHeader *header = (const columnar::BlockHeader *)(base + entry.offset);
+		if (!header->count || header->count != entry.count || header->ts_width > 64 || header->value_width > 64)
+			return false;
+		uint64_t words = columnar::packedWords(header->count, header->ts_width) + columnar::packedWords(header->count, header->value_width);
+		return words <= (index_offset - entry.offset - sizeof(columnar::BlockHeader)) / sizeof(uint64_t);
+	}
+
+private:
+	const char *base;
+	size_t length;
+	const columnar::IndexEntry *index;
+	size_t block_count;
+	std::vector<int64_t> max_before;
+	std::vector<int64_t> min_after;
+	mutable std::vector<uint64_t> decoded;
+};
+
+//append every message of a numeric topic to writer, stamped with its enqueue time
+template <typename T>
+void recordTopic(ThreadSafeMsgQueuePtr queue, std::string topic, ColumnarWriterPtr<T> writer)
+{
+	queue->subscribe<T>(topic, [writer](const MsgPtr<T> msg) {
+		writer->append(msg->gettimestamp(), msg->getContent());
+	});
+}
@@ -0,0 +1,137 @@
+#pragma once
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <unordered_set>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+
+class DedupFilter;
+using DedupFilterPtr = std::shared_ptr<DedupFilter>;
+
+//Remembers message ids for one to two windows. Each window has a blocked Bloom filter (all
+//probes of an id hit one 64-byte block) in front of an exact id set, so unseen ids are
+//rejected with a single cache line and Bloom false positives never drop a message. The exact
+//set is capped; past the cap an id is only remembered by the filter and duplicates may pass.
+class DedupFilter
+{
+public:
+	DedupFilter(int64_t _window_us = 10000000, size_t _expected_ids = 1 << 16) : window_us(_window_us),
+																				  max_exact(_expected_ids),
+																				  generation_start(0)
+	{
+		//about 10 bits per id
+		size_t blocks = (std::max)((size_t)1, (_expected_ids * 10 + 511) / 512);
+		generations[0].blocks.resize(blocks);
+		generations[1].blocks.resize(blocks);
+	}
+	~DedupFilter()
+	{
+	}
+
+	//false when id was already seen within the window; id 0 is never deduplicated
+	bool admit(uint64_t id, int64_t now_us)
+	{
+		if (!id)
+			return true;
+		uint64_t h = mix(id);
+		std::lock_guard<std::mutex> lg(mtx);
+		if (now_us - generation_start >= window_us)
+			rotate(now_us);
+		for (int g = 0; g < 2; ++g)
+		{
+			if (generations[g].mayContain(h) && generations[g].exact.count(id))
+				return false;
+		}
+		Generation &current = generations[0];
+		current.insert(h);
+		if (current.exact.size() < max_exact)
+			current.exact.insert(id);
+		return true;
+	}
+
+	//let id through again, for a message admit() passed that was dropped after all
+	void forget(uint64_t id)
+	{
+		std::lock_guard<std::mutex> lg(mtx);
+		generations[0].exact.erase(id);
+		generations[1].exact.erase(id);
+	}
+
+private:
+	struct Block
+	{
+		uint64_t words[8];
+	};
+
+	struct Generation
+	{
+		std::vector<Block> blocks;
+		std::unordered_set<uint64_t> exact;
+
+		Block &block(uint64_t h)
+		{
+			return blocks[(h >> 32) % blocks.size()];
+		}
+
+		//eight probes by double hashing on the low word, all inside one block
+		static uint32_t probe(uint64_t h, int k)
+		{
+			return ((uint32_t)h + k * ((uint32_t)(h >> 16) | 1)) & 511;
+		}
+
+		bool mayContain(uint64_t h)
+		{
+			Block &b = block(h);
+			for (int k = 0; k < 8; ++k)
+			{
+				uint32_t bit = probe(h, k);
+				if (!(b.words[bit >> 6] & (1ull << (bit & 63))))
+					return false;
+			}
+			return true;
+		}
+
+		void insert(uint64_t h)
+		{
+			Block &b = block(h);
+			for (int k = 0; k < 8; ++k)
+			{
+				uint32_t bit = probe(h, k);
+				b.words[bit >> 6] |= 1ull << (bit & 63);
+			}
+		}
+
+		void clear()
+		{
+			memset(&blocks[0], 0, blocks.size() * sizeof(Block));
+			exact.clear();
+		}
+	};
+
+	static uint64_t mix(uint64_t x)
+	{
+		x += 0x9e3779b97f4a7c15ull;
+		x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+		x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+		return x ^ (x >> 31);
+	}
+
+	void rotate(int64_t now_us)
+	{
+		std::swap(generations[0], generations[1]);
+		//a gap longer than two windows forgets both
+		if (now_us - generation_start >= 2 * window_us)
+			generations[1].clear();
+		generations[0].clear();
+		generation_start = now_us;
+	}
+
+private:
+	std::mutex mtx;
+	int64_t window_us;
+	size_t max_exact;
+	int64_t generation_start;
+	Generation generations[2];
+};
@@ -0,0 +1,263 @@
+#pragma once
+
+#include <atomic>
+#include <list>
+#include <mutex>
+#include <condition_variable>
+#include "ThreadSafeMsgQueue.h"
+#include "RealTime.h"
+
+class DispatcherPool;
+using DispatcherPoolPtr = std::shared_ptr<DispatcherPool>;
+
+struct DispatcherPoolConfig
+{
+	DispatcherPoolConfig() : min_workers(1),
+							 max_workers(std::thread::hardware_concurrency() ? std::thread::hardware_concurrency() : 1),
+							 sample_interval(std::chrono::milliseconds(100)),
+							 idle_sleep(std::chrono::milliseconds(20)),
+							 scale_up_lag(5000),
+							 scale_up_backlog(64),
+							 scale_down_lag(1000),
+							 scale_down_utilization(0.3),
+							 scale_up_samples(2),
+							 scale_down_samples(10),
+							 sched_policy(-1),
+							 sched_priority(0),
+							 no_alloc_after(0)
+	{
+	}
+
+	size_t min_workers;
+	size_t max_workers;
+	std::chrono::milliseconds sample_interval;
+	std::chrono::milliseconds idle_sleep;
+	//grow when the worst queueing delay (microseconds) or the backlog per worker exceeds these
+	int64_t scale_up_lag;
+	size_t scale_up_backlog;
+	//shrink only when lag is below scale_down_lag and workers are mostly idle
+	int64_t scale_down_lag;
+	double scale_down_utilization;
+	//consecutive samples a condition must hold before acting (hysteresis)
+	int scale_up_samples;
+	int scale_down_samples;
+	//scheduling class for workers (e.g. SCHED_FIFO), -1 keeps the default
+	int sched_policy;
+	int sched_priority;
+	//after this many dispatch rounds a worker runs inside realtime::NoAllocScope, 0 = never
+	size_t no_alloc_after;
+};
+
+//Runs ThreadSafeMsgQueue::runOnce() on a pool of threads whose size follows queue lag and callback utilization.
+class DispatcherPool
+{
+public:
+	DispatcherPool(ThreadSafeMsgQueuePtr queue_, const DispatcherPoolConfig &config_ = DispatcherPoolConfig()) : queue(queue_),
+																												   config(config_),
+																												   running(false),
+																												   busy_ns(0),
+																												   last_utilization(0),
+																												   last_lag(0)
+	{
+		if (config.max_workers < config.min_workers)
+			config.max_workers = config.min_workers;
+	}
+	~DispatcherPool()
+	{
+		stop();
+	}
+
+	void start()
+	{
+		std::lock_guard<std::mutex> lg(mtx);
+		if (running)
+			return;
+		running = true;
+		while (workers.size() < (std::max)(config.min_workers, (size_t)1))
+			addWorker();
+		controller = std::thread(&DispatcherPool::control, this);
+	}
+
+	void stop()
+	{
+		{
+			std::lock_guard<std::mutex> lg(mtx);
+			if (!running)
+				return;
+			running = false;
+		}
+		cv.notify_all();
+		controller.join();
+		std::lock_guard<std::mutex> lg(mtx);
+		while (!workers.empty())
+			removeWorker();
+	}
+
+	size_t size()
+	{
+		std::lock_guard<std::mutex> lg(mtx);
+		return workers.size();
+	}
+
+	//fraction of worker time spent dispatching during the last sample interval
+	double utilization() const
+	{
+		return last_utilization;
+	}
+
+	int64_t lag() const
+	{
+		return last_lag;
+	}
+
+private:
+	struct Worker
+	{
+		std::shared_ptr<std::atomic<bool> > stop;
+		std::thread thread;
+	};
+
+	//the broker splits topics between as many runOnce() callers as there are workers
+	void addWorker()
+	{
+		Worker worker;
+		worker.stop = std::make_shared<std::atomic<bool> >(false);
+		worker.thread = std::thread(&DispatcherPool::work, this, worker.stop);
+		workers.push_back(std::move(worker));
+		queue->setDispatchers(workers.size());
+	}
+
+	//the newest worker goes first so long-lived threads keep their warm caches
+	void removeWorker()
+	{
+		Worker &worker = workers.back();
+		*worker.stop = true;
+		worker.thread.join();
+		workers.pop_back();
+		queue->setDispatchers(workers.size());
+	}
+
+	void work(std::shared_ptr<std::atomic<bool> > stop_flag)
+	{
+		if (config.sched_policy >= 0)
+			realtime::setThreadScheduling(config.sched_policy, config.sched_priority);
+		size_t rounds = 0;
+		while (!*stop_flag)
+		{
+			auto begin = std::chrono::steady_clock::now();
+			bool busy;
+			if (config.no_alloc_after && rounds >= config.no_alloc_after)
+			{
+				realtime::NoAllocScope no_alloc;
+				busy = queue->runOnce();
+			}
+			else
+			{
+				busy = queue->runOnce();
+				++rounds;
+			}
+			if (busy)
+			{
+				busy_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - begin).count();
+			}
+			else
+			{
+				std::this_thread::sleep_for(config.idle_sleep);
+			}
+		}
+	}
+
+	void control()
+	{
+		int up_streak = 0;
+		int down_streak = 0;
+		auto last_sample = std::chrono::steady_clock::now();
+		std::unique_lock<std::mutex> lk(mtx);
+		while (running)
+		{
+			cv.wait_for(lk, config.sample_interval, [&] { return !running; });
+			if (!running)
+				break;
+
+			auto sample = std::chrono::steady_clock::now();
+			int64_t elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(sample - last_sample).count();
+			last_sample = sample;
+			int64_t busy = busy_ns.exchange(0);
+			double utilization = elapsed > 0 && !workers.empty() ? (double)busy / ((double)elapsed * workers.size()) : 0;
+			last_utilization = utilization;
+
+			//sampling the broker takes its lock; do not hold ours meanwhile
+			lk.unlock();
+			int64_t lag = queue->lag();
+			size_t backlog = queue->size();
+			lk.lock();
+			if (!running)
+				break;
+			last_lag = lag;
+
+			bool overloaded = lag > config.scale_up_lag || backlog > config.scale_up_backlog * workers.size();
+			bool underloaded = lag < config.scale_down_lag && utilization < config.scale_down_utilization;
+			up_streak = overloaded ? up_streak + 1 : 0;
+			down_streak = underloaded ? down_streak + 1 : 0;
+
+			if (up_streak >= config.scale_up_samples && workers.size() < config.max_workers)
+			{
+				addWorker();
+				up_streak = 0;
+				down_streak = 0;
+			}
+			else if (down_streak >= config.scale_down_samples && workers.size() > config.min_workers)
+			{
+				removeWorker();
+				up_streak = 0;
+				down_streak = 0;
+			}
+		}
+	}
+
+private:
+	ThreadSafeMsgQueuePtr queue;
+	DispatcherPoolConfig config;
+	std::mutex mtx;
+	std::condition_variable cv;
+	bool running;
+	std::list<Worker> workers;
+	std::thread controller;
+	std::atomic<int64_t> busy_ns;
+	std::atomic<double> last_utilization;
+	std::atomic<int64_t> last_lag;
+};
+
+//configure broker from config, apply its real-time settings and start the dispatcher pool it
+//describes, so topics, storage and dispatcher threads all exist, resident, before the first
+//publish; nullptr when configure failed or memory could not be locked
+inline DispatcherPoolPtr startBroker(ThreadSafeMsgQueuePtr broker, const BrokerConfig &config, std::string *error = nullptr)
+{
+	if (!broker->configure(config, error))
+		return nullptr;
+	if (config.prefault)
+		broker->prefault();
+	if (config.lock_memory || config.prefault_stack || config.prefault_heap)
+	{
+		realtime::RealTimeConfig rt;
+		rt.lock_memory = config.lock_memory;
+		rt.prefault_stack = config.prefault_stack;
+		rt.prefault_heap = config.prefault_heap;
+		if (!realtime::enter(rt))
+		{
+			if (error)
+				*error = "lock_memory: mlockall failed";
+			return nullptr;
+		}
+	}
+	DispatcherPoolConfig pool_config;
+	pool_config.min_workers = config.min_workers;
+	if (config.max_workers)
+		pool_config.max_workers = config.max_workers;
+	pool_config.sched_policy = config.sched_policy;
+	pool_config.sched_priority = config.sched_priority;
+	pool_config.no_alloc_after = config.no_alloc_after;
+	DispatcherPoolPtr pool(new DispatcherPool(broker, pool_config));
+	pool->start();
+	return pool;
+}
@@ -0,0 +1,187 @@
+#pragma once
+#include "MsgQueue.h"
+#include <climits>
+
+template <typename Policy>
+class BasicEdfMsgQueue;
+using EdfMsgQueue = BasicEdfMsgQueue<ThreadedPolicy>;
+using EdfMsgQueuePtr = std::shared_ptr<EdfMsgQueue>;
+
+//earliest deadline first; messages without a deadline go last, ties by priority, then FIFO
+struct BaseMsgPtrLaterDeadline
+{
+	bool operator()(const BaseMsgPtr &a, const BaseMsgPtr &b) const
+	{
+		int64_t da = a->getdeadline() ? a->getdeadline() : INT64_MAX;
+		int64_t db = b->getdeadline() ? b->getdeadline() : INT64_MAX;
+		if (da != db)
+			return da > db;
+		return *a < *b;
+	}
+};
+
+//Dequeues by BaseMsg::getdeadline() instead of priority. Messages dequeued past their deadline
+//count in missed(); with drop_missed they are discarded there (and count in dropped() too), so
+//under overload the dispatcher only spends time on work that can still make its deadline.
+//Spill is not supported and behaves like Block.
+template <typename Policy>
+class BasicEdfMsgQueue : public BasicMsgQueue<Policy>
+{
+public:
+	typedef BasicMsgQueue<Policy> Base;
+	typedef typename Base::Mutex Mutex;
+	typedef typename Base::Condition Condition;
+	typedef typename Base::Container Container;
+
+	explicit BasicEdfMsgQueue(bool _drop_missed = false) : drop_missed(_drop_missed), next_seq(0)
+	{
+	}
+	~BasicEdfMsgQueue()
+	{
+	}
+
+	virtual bool enqueue(BaseMsgPtr msg, Admission admission = Admission::Wait)
+	{
+		if (this->isDuplicate(msg))
+			return this->refuse(msg, admission);
+		if (!this->admit(msg, admission))
+		{
+			this->forgetId(msg);
+			return false;
+		}
+		std::lock_guard<Mutex> lg(this->mtx);
+		msg->settimestamp(this->now());
+		msg->setseq(next_seq++);
+		heap.push_back(msg);
+		std::push_heap(heap.begin(), heap.end(), BaseMsgPtrLaterDeadline());
+		this->cv.notify_all();
+		return true;
+	}
+
+	virtual BaseMsgPtr dequeue()
+	{
+		std::lock_guard<Mutex> lg(this->mtx);
+		return take();
+	}
+
+	virtual BaseMsgPtr dequeue_block()
+	{
+		std::unique_lock<Mutex> lg(this->mtx);
+		while (true)
+		{
+			this->cv.wait(lg, [&] { return !heap.empty(); });
+			BaseMsgPtr result = take();
+			if (result || !Condition::can_wait)
+				return result;
+		}
+	}
+
+	virtual size_t dequeue_batch(std::vector<BaseMsgPtr> &out, size_t max)
+	{
+		std::lock_guard<Mutex> lg(this->mtx);
+		size_t n = 0;
+		for (; n < max; ++n)
+		{
+			BaseMsgPtr msg = take();
+			if (!msg)
+				break;
+			out.push_back(msg);
+		}
+		return n;
+	}
+
+	virtual size_t size()
+	{
+		std::lock_guard<Mutex> lg(this->mtx);
+		return heap.size();
+	}
+
+	virtual int64_t headAge()
+	{
+		std::lock_guard<Mutex> lg(this->mtx);
+		return heap.empty() ? 0 : this->now() - heap.front()->gettimestamp();
+	}
+
+	//the heap is a plain vector, so huge_pages has no effect here
+	virtual void reserve(size_t messages, bool = false)
+	{
+		std::lock_guard<Mutex> lg(this->mtx);
+		heap.reserve(messages);
+	}
+
+	virtual void prefault()
+	{
+		std::lock_guard<Mutex> lg(this->mtx);
+		this->touch(heap.data(), heap.capacity() * sizeof(BaseMsgPtr));
+	}
+
+	virtual bool setMemoryResource(MemoryResourcePtr resource)
+	{
+		std::lock_guard<Mutex> lg(this->mtx);
+		if (!heap.empty())
+			return false;
+		Container fresh((ResourceAllocator<BaseMsgPtr>(resource)));
+		fresh.reserve(heap.capacity());
+		heap.swap(fresh);
+		return true;
+	}
+
+	void setDropMissed(bool _drop_missed)
+	{
+		std::lock_guard<Mutex> lg(this->mtx);
+		drop_missed = _drop_missed;
+	}
+
+protected:
+	//DropOldest gives up the least urgent message rather than the next one due
+	virtual bool evict()
+	{
+		std::lock_guard<Mutex> lg(this->mtx);
+		if (heap.empty())
+			return false;
+		auto victim = std::min_element(heap.begin(), heap.end(), BaseMsgPtrLaterDeadline());
+		BaseMsgPtr msg = std::move(*victim);
+		heap.erase(victim);
+		std::make_heap(heap.begin(), heap.end(), BaseMsgPtrLaterDeadline());
+		this->release(msg);
+		return true;
+	}
+
+private:
+	//next message that is still worth delivering, nullptr once empty; caller holds mtx
+	BaseMsgPtr take()
+	{
+		int64_t t = this->now();
+		while (!heap.empty())
+		{
+			std::pop_heap(heap.begin(), heap.end(), BaseMsgPtrLaterDeadline());
+			BaseMsgPtr result = std::move(heap.back());
+			heap.pop_back();
+			this->last_sojourn = t - result->gettimestamp();
+			this->release(result);
+			if (!result->claim())
+			{
+				++this->cancel_count;
+				continue;
+			}
+			if (result->getdeadline() && result->getdeadline() < t)
+			{
+				++this->miss_count;
+				if (drop_missed)
+				{
+					++this->drop_count;
+					continue;
+				}
+			}
+			if (this->aqmDrop(result, this->last_sojourn, heap.empty()))
+				continue;
+			return result;
+		}
+		return nullptr;
+	}
+
+private:
+	bool drop_missed;
+	uint64_t next_seq;
+	Container heap;
+};
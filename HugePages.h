@@ -0,0 +1,65 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <sys/mman.h>
+
+//Page-aligned mappings backed by 2 MiB pages, for large rings and pools where 4 KiB pages cost
+//one TLB entry per page. Explicit huge pages (MAP_HUGETLB) are used when the system has them
+//reserved; otherwise the mapping is aligned to 2 MiB and marked for transparent huge pages.
+namespace hugepage
+{
+	enum
+	{
+		SIZE = 2 << 20
+	};
+
+	enum class Backing
+	{
+		None,		 //mapping failed
+		Explicit,	//MAP_HUGETLB pages from the reserved pool
+		Transparent, //ordinary pages with MADV_HUGEPAGE; the kernel may still use 4 KiB pages
+	};
+
+	inline size_t roundUp(size_t bytes)
+	{
+		return (bytes + SIZE - 1) & ~(size_t)(SIZE - 1);
+	}
+
+	//bytes is rounded up to a whole number of huge pages; release with unmap(p, bytes)
+	inline void *map(size_t bytes, Backing *backing = nullptr)
+	{
+		size_t length = roundUp(bytes);
+		if (backing)
+			*backing = Backing::None;
+#ifdef MAP_HUGETLB
+		void *p = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (p != MAP_FAILED)
+		{
+			if (backing)
+				*backing = Backing::Explicit;
+			return p;
+		}
+#endif
+		//over-map by one huge page and trim both ends so the region starts on a 2 MiB boundary
+		char *raw = (char *)mmap(nullptr, length + SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (raw == (char *)MAP_FAILED)
+			return nullptr;
+		char *aligned = (char *)(((uintptr_t)raw + SIZE - 1) & ~(uintptr_t)(SIZE - 1));
+		size_t head = aligned - raw;
+		if (head)
+			munmap(raw, head);
+		munmap(aligned + length, SIZE - head);
+#ifdef MADV_HUGEPAGE
+		madvise(aligned, length, MADV_HUGEPAGE);
+#endif
+		if (backing)
+			*backing = Backing::Transparent;
+		return aligned;
+	}
+
+	inline void unmap(void *p, size_t bytes)
+	{
+		if (p)
+			munmap(p, roundUp(bytes));
+	}
+}
@@ -0,0 +1,84 @@
+#pragma once
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+
+class MemoryBudget;
+using MemoryBudgetPtr = std::shared_ptr<MemoryBudget>;
+
+//Byte counter with an optional limit (0 = unlimited), shared by the queues it bounds.
+class MemoryBudget
+{
+public:
+	explicit MemoryBudget(size_t _limit = 0) : limit_bytes(_limit), used_bytes(0), waiters(0)
+	{
+	}
+	~MemoryBudget()
+	{
+	}
+
+	//a message larger than the whole limit is still admitted into an empty budget
+	bool tryAcquire(size_t bytes)
+	{
+		size_t used = used_bytes.load();
+		while (true)
+		{
+			size_t limit = limit_bytes.load();
+			if (limit && used && used + bytes > limit)
+				return false;
+			if (used_bytes.compare_exchange_weak(used, used + bytes))
+				return true;
+		}
+	}
+
+	void acquire(size_t bytes)
+	{
+		if (tryAcquire(bytes))
+			return;
+		std::unique_lock<std::mutex> lk(mtx);
+		++waiters;
+		cv.wait(lk, [&] { return tryAcquire(bytes); });
+		--waiters;
+	}
+
+	//charge regardless of the limit
+	void charge(size_t bytes)
+	{
+		used_bytes.fetch_add(bytes);
+	}
+
+	void release(size_t bytes)
+	{
+		used_bytes.fetch_sub(bytes);
+		if (waiters.load())
+		{
+			std::lock_guard<std::mutex> lg(mtx);
+			cv.notify_all();
+		}
+	}
+
+	size_t used() const
+	{
+		return used_bytes.load();
+	}
+
+	size_t limit() const
+	{
+		return limit_bytes.load();
+	}
+
+	void setLimit(size_t _limit)
+	{
+		limit_bytes = _limit;
+		std::lock_guard<std::mutex> lg(mtx);
+		cv.notify_all();
+	}
+
+private:
+	std::atomic<size_t> limit_bytes;
+	std::atomic<size_t> used_bytes;
+	std::atomic<int> waiters;
+	std::mutex mtx;
+	std::condition_variable cv;
+};
@@ -0,0 +1,286 @@
+#pragma once
+#include "Msg.h"
+#include <mutex>
+#include <vector>
+#include <new>
+#include <cstddef>
+
+class MemoryResource;
+using MemoryResourcePtr = std::shared_ptr<MemoryResource>;
+
+//Where allocator-aware storage gets its memory, in the spirit of std::pmr::memory_resource (not
+//available in C++11). Blocks are 16-byte aligned. Implementations are thread safe, as queues,
+//publishers and dispatchers share them.
+class MemoryResource
+{
+public:
+	virtual ~MemoryResource() {}
+	virtual void *allocate(size_t bytes) = 0;
+	virtual void deallocate(void *p, size_t bytes) = 0;
+
+	//operator new and delete, used wherever no resource is configured
+	static MemoryResourcePtr defaultResource();
+
+protected:
+	static size_t align(size_t bytes)
+	{
+		return (bytes + 15) & ~(size_t)15;
+	}
+};
+
+class NewDeleteResource : public MemoryResource
+{
+public:
+	virtual void *allocate(size_t bytes)
+	{
+		return ::operator new(bytes);
+	}
+
+	virtual void deallocate(void *p, size_t)
+	{
+		::operator delete(p);
+	}
+};
+
+inline MemoryResourcePtr MemoryResource::defaultResource()
+{
+	static MemoryResourcePtr instance(new NewDeleteResource());
+	return instance;
+}
+
+//Bump allocation from growing blocks; deallocate does nothing and everything is returned at once
+//by release() or destruction. For request-scoped topics, where the cost of an allocation drops to
+//a pointer increment.
+class MonotonicResource : public MemoryResource
+{
+public:
+	explicit MonotonicResource(size_t _block_bytes = 64 * 1024, MemoryResourcePtr _upstream = MemoryResource::defaultResource()) : upstream(_upstream),
+																																	 block_bytes(align((std::max)(_block_bytes, (size_t)256))),
+																																	 next_block(block_bytes),
+																																	 cur(nullptr),
+																																	 end(nullptr),
+																																	 used_bytes(0)
+	{
+	}
+	~MonotonicResource()
+	{
+		release();
+	}
+	MonotonicResource(const MonotonicResource &) = delete;
+	MonotonicResource &operator=(const MonotonicResource &) = delete;
+
+	virtual void *allocate(size_t bytes)
+	{
+		bytes = align(bytes);
+		std::lock_guard<std::mutex> lg(mtx);
+		if ((size_t)(end - cur) < bytes)
+		{
+			size_t size = (std::max)(next_block, bytes);
+			cur = (char *)upstream->allocate(size);
+			end = cur + size;
+			blocks.push_back(std::make_pair(cur, size));
+			//double up to 16 blocks' worth, so a long-lived arena needs few upstream calls
+			next_block = (std::min)(next_block * 2, block_bytes * 16);
+		}
+		void *p = cur;
+		cur += bytes;
+		used_bytes += bytes;
+		return p;
+	}
+
+	virtual void deallocate(void *, size_t)
+	{
+	}
+
+	//free every block; nothing allocated from the resource may still be in use
+	void release()
+	{
+		std::lock_guard<std::mutex> lg(mtx);
+		for (size_t i = 0; i < blocks.size(); ++i)
+			upstream->deallocate(blocks[i].first, blocks[i].second);
+		blocks.clear();
+		cur = end = nullptr;
+		next_block = block_bytes;
+		used_bytes = 0;
+	}
+
+	//bytes handed out since the last release
+	size_t used()
+	{
+		std::lock_guard<std::mutex> lg(mtx);
+		return used_bytes;
+	}
+
+	size_t blockBytes() const
+	{
+		return block_bytes;
+	}
+
+	MemoryResourcePtr upstreamResource() const
+	{
+		return upstream;
+	}
+
+private:
+	std::mutex mtx;
+	MemoryResourcePtr upstream;
+	size_t block_bytes;
+	size_t next_block;
+	char *cur;
+	char *end;
+	size_t used_bytes;
+	std::vector<std::pair<char *, size_t> > blocks;
+};
+
+//Free lists for power-of-two size classes from 16 bytes to max_block, refilled from upstream
+//chunk_blocks blocks at a time; larger requests go straight upstream. Freed blocks are reused,
+//so long-lived topics stop calling the global allocator once warmed up.
+class PoolResource : public MemoryResource
+{
+public:
+	explicit PoolResource(size_t _max_block = 4096, size_t _chunk_blocks = 64, MemoryResourcePtr _upstream = MemoryResource::defaultResource()) : upstream(_upstream),
+																																					chunk_blocks((std::max)(_chunk_blocks, (size_t)1)),
+																																					upstream_count(0)
+	{
+		size_t size = 16;
+		while (size < _max_block)
+			size <<= 1;
+		lists.resize(classOf(size) + 1, nullptr);
+	}
+	~PoolResource()
+	{
+		for (size_t i = 0; i < chunks.size(); ++i)
+			upstream->deallocate(chunks[i].first, chunks[i].second);
+	}
+	PoolResource(const PoolResource &) = delete;
+	PoolResource &operator=(const PoolResource &) = delete;
+
+	virtual void *allocate(size_t bytes)
+	{
+		size_t c = classOf(bytes);
+		std::lock_guard<std::mutex> lg(mtx);
+		if (c >= lists.size())
+		{
+			++upstream_count;
+			return upstream->allocate(bytes);
+		}
+		if (!lists[c])
+			refill(c);
+		Node *node = lists[c];
+		lists[c] = node->next;
+		return node;
+	}
+
+	virtual void deallocate(void *p, size_t bytes)
+	{
+		size_t c = classOf(bytes);
+		std::lock_guard<std::mutex> lg(mtx);
+		if (c >= lists.size())
+		{
+			upstream->deallocate(p, bytes);
+			return;
+		}
+		Node *node = (Node *)p;
+		node->next = lists[c];
+		lists[c] = node;
+	}
+
+	//calls made to upstream, chunk refills included
+	size_t upstreamCalls()
+	{
+		std::lock_guard<std::mutex> lg(mtx);
+		return upstream_count;
+	}
+
+private:
+	struct Node
+	{
+		Node *next;
+	};
+
+	//16 -> 0, 32 -> 1, ...
+	static size_t classOf(size_t bytes)
+	{
+		size_t c = 0;
+		for (size_t size = 16; size < bytes; size <<= 1)
+			++c;
+		return c;
+	}
+
+	//caller holds mtx
+	void refill(size_t c)
+	{
+		size_t size = (size_t)16 << c;
+		size_t bytes = size * chunk_blocks;
+		char *chunk = (char *)upstream->allocate(bytes);
+		++upstream_count;
+		chunks.push_back(std::make_pair(chunk, bytes));
+		for (size_t i = chunk_blocks; i-- > 0;)
+		{
+			Node *node = (Node *)(chunk + i * size);
+			node->next = lists[c];
+			lists[c] = node;
+		}
+	}
+
+private:
+	std::mutex mtx;
+	MemoryResourcePtr upstream;
+	size_t chunk_blocks;
+	size_t upstream_count;
+	std::vector<Node *> lists;
+	std::vector<std::pair<char *, size_t> > chunks;
+};
+
+//std allocator over a MemoryResource. It keeps the resource alive, so messages and containers
+//may outlive whoever configured it; it follows its container on move and swap.
+template <typename T>
+class ResourceAllocator
+{
+public:
+	typedef T value_type;
+	typedef std::true_type propagate_on_container_move_assignment;
+	typedef std::true_type propagate_on_container_swap;
+
+	ResourceAllocator() : resource(MemoryResource::defaultResource()) {}
+	explicit ResourceAllocator(MemoryResourcePtr _resource) : resource(_resource ? _resource : MemoryResource::defaultResource()) {}
+	template <typename U>
+	ResourceAllocator(const ResourceAllocator<U> &other) : resource(other.resource) {}
+
+	T *allocate(size_t n)
+	{
+		return (T *)resource->allocate(n * sizeof(T));
+	}
+
+	void deallocate(T *p, size_t n)
+	{
+		resource->deallocate(p, n * sizeof(T));
+	}
+
+	template <typename U>
+	struct rebind
+	{
+		typedef ResourceAllocator<U> other;
+	};
+
+	template <typename U>
+	bool operator==(const ResourceAllocator<U> &other) const
+	{
+		return resource == other.resource;
+	}
+
+	template <typename U>
+	bool operator!=(const ResourceAllocator<U> &other) const
+	{
+		return resource != other.resource;
+	}
+
+	MemoryResourcePtr resource;
+};
+
+//a message and its control block in one allocation from resource
+template <typename T, typename C>
+MsgPtr<T> makeMsg(const MemoryResourcePtr &resource, C &&content, int priority = 0)
+{
+	return std::allocate_shared<Msg<T> >(ResourceAllocator<Msg<T> >(resource), std::forward<C>(content), priority);
+}
@@ -1,24 +1,35 @@
 #pragma once
 
 #include <memory>
+#include <atomic>
+#include <thread>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <type_traits>
+#include <algorithm>
 
 class BaseMsg;
 using BaseMsgPtr = std::shared_ptr<BaseMsg>;
 
+//rebuilds a message from bytes written by BaseMsg::serialize()
+typedef BaseMsgPtr (*MsgLoader)(const char *data, size_t len, int priority);
+
 class BaseMsg : public std::enable_shared_from_this<BaseMsg>
 {
 public:
-	BaseMsg(int _priority = 0) : priority(_priority), timestamp(0) {}
+	BaseMsg(int _priority = 0) : priority(_priority), timestamp(0), seq(0), bytes(0), id(0), deadline(0), marked(false), state(UNTRACKED) {}
 	virtual ~BaseMsg() {}
 	BaseMsgPtr shared_from_base()
 	{
 		return shared_from_this();
 	}
 
-	bool operator<(const BaseMsg &other)
+	bool operator<(const BaseMsg &other) const
 	{
 		if (priority == other.priority)
-			return timestamp > other.timestamp;
+			return seq > other.seq;
 		return priority < other.priority;
 	}
 
@@ -27,19 +38,281 @@ public:
 		timestamp = _timestamp;
 	}
 
+	int64_t gettimestamp() const
+	{
+		return timestamp;
+	}
+
+	int getpriority() const
+	{
+		return priority;
+	}
+
+	//enqueue order within a queue, breaks ties between equal priorities
+	void setseq(uint64_t _seq)
+	{
+		seq = _seq;
+	}
+
+	uint64_t getseq() const
+	{
+		return seq;
+	}
+
+	//heap bytes held by this message, payload included
+	virtual size_t byteSize() const
+	{
+		return sizeof(BaseMsg);
+	}
+
+	//byteSize() as charged to the memory budgets when queued, so release matches acquire
+	void setbytes(size_t _bytes)
+	{
+		bytes = _bytes;
+	}
+
+	size_t getbytes() const
+	{
+		return bytes;
+	}
+
+	//idempotency key set by the publisher, 0 = none; topics with a DedupFilter drop repeats
+	void setid(uint64_t _id)
+	{
+		id = _id;
+	}
+
+	uint64_t getid() const
+	{
+		return id;
+	}
+
+	//absolute deadline on MsgQueue::now()'s clock (microseconds), 0 = none; an EdfMsgQueue
+	//dequeues the earliest deadline first
+	void setdeadline(int64_t _deadline)
+	{
+		deadline = _deadline;
+	}
+
+	int64_t getdeadline() const
+	{
+		return deadline;
+	}
+
+	//set by a queue's AQM in marking mode: the message waited in a congested queue
+	void setmarked(bool _marked)
+	{
+		marked = _marked;
+	}
+
+	bool getmarked() const
+	{
+		return marked;
+	}
+
+	//Cancel/replace support behind MsgHandle. A tracked message is pending until a queue claims
+	//it on dequeue; from then on it can no longer be cancelled or replaced. Untracked messages
+	//(the default) are always claimable, so one message may still be published to many topics.
+	void track()
+	{
+		state.store(PENDING, std::memory_order_release);
+	}
+
+	//called by a queue as it hands the message out; false when it was cancelled (a tombstone)
+	bool claim()
+	{
+		int s = state.load(std::memory_order_acquire);
+		while (true)
+		{
+			if (s == UNTRACKED || s == CLAIMED)
+				return true;
+			if (s == CANCELLED)
+				return false;
+			if (s == BUSY)
+			{
+				std::this_thread::yield();
+				s = state.load(std::memory_order_acquire);
+				continue;
+			}
+			if (state.compare_exchange_weak(s, CLAIMED, std::memory_order_acq_rel))
+				return true;
+		}
+	}
+
+	//tombstone a pending message; the queue discards it when it reaches the head
+	bool cancel()
+	{
+		if (!lockPending())
+			return false;
+		state.store(CANCELLED, std::memory_order_release);
+		return true;
+	}
+
+	bool pending() const
+	{
+		int s = state.load(std::memory_order_acquire);
+		return s == PENDING || s == BUSY;
+	}
+
+	//append the payload to out; false when the payload type has no MsgSerializeTrait
+	virtual bool serialize(std::string &) const
+	{
+		return false;
+	}
+
+	virtual MsgLoader loader() const
+	{
+		return nullptr;
+	}
+
 protected:
 	int priority;
 	int64_t timestamp;
+	uint64_t seq;
+	size_t bytes;
+	uint64_t id;
+	int64_t deadline;
+	bool marked;
+
+	//hold a pending message while its content is rewritten; false once claimed or cancelled
+	bool lockPending()
+	{
+		int s = PENDING;
+		while (!state.compare_exchange_weak(s, BUSY, std::memory_order_acquire))
+		{
+			if (s != PENDING && s != BUSY)
+				return false;
+			if (s == BUSY)
+				std::this_thread::yield();
+			s = PENDING;
+		}
+		return true;
+	}
+
+	void unlockPending()
+	{
+		state.store(PENDING, std::memory_order_release);
+	}
+
+private:
+	enum
+	{
+		UNTRACKED,
+		PENDING,
+		BUSY,
+		CLAIMED,
+		CANCELLED
+	};
+	std::atomic<int> state;
 };
 
 struct BaseMsgPtrCompareLess
 {
-	bool operator()(BaseMsgPtr a, BaseMsgPtr b)
+	bool operator()(const BaseMsgPtr &a, const BaseMsgPtr &b) const
 	{
 		return (*a) < (*b);
 	}
 };
 
+//Bytes a payload owns beyond sizeof(T); specialize for types holding heap storage.
+template <typename T>
+struct MsgSizeTrait
+{
+	static size_t size(const T &) { return 0; }
+};
+
+template <typename CharT, typename Traits, typename Alloc>
+struct MsgSizeTrait<std::basic_string<CharT, Traits, Alloc> >
+{
+	static size_t size(const std::basic_string<CharT, Traits, Alloc> &s) { return s.capacity() * sizeof(CharT); }
+};
+
+template <typename T, typename D>
+struct MsgSizeTrait<std::unique_ptr<T, D> >
+{
+	static size_t size(const std::unique_ptr<T, D> &p) { return p ? sizeof(T) + MsgSizeTrait<T>::size(*p) : 0; }
+};
+
+//the array length is not known
+template <typename T, typename D>
+struct MsgSizeTrait<std::unique_ptr<T[], D> >
+{
+	static size_t size(const std::unique_ptr<T[], D> &) { return 0; }
+};
+
+template <typename T, typename Alloc>
+struct MsgSizeTrait<std::vector<T, Alloc> >
+{
+	static size_t size(const std::vector<T, Alloc> &v)
+	{
+		size_t total = v.capacity() * sizeof(T);
+		for (size_t i = 0; i < v.size(); ++i)
+			total += MsgSizeTrait<T>::size(v[i]);
+		return total;
+	}
+};
+
+//Byte encoding of a payload; enabled for trivially copyable types, strings and vectors of those.
+template <typename T, typename Enable = void>
+struct MsgSerializeTrait
+{
+	static const bool enabled = false;
+};
+
+template <typename T>
+struct MsgSerializeTrait<T, typename std::enable_if<std::is_trivially_copyable<T>::value && std::is_default_constructible<T>::value>::type>
+{
+	static const bool enabled = true;
+	static void write(const T &t, std::string &out) { out.append((const char *)&t, sizeof(T)); }
+	static T read(const char *data, size_t len)
+	{
+		T t;
+		memcpy(&t, data, (std::min)(len, sizeof(T)));
+		return t;
+	}
+};
+
+template <typename CharT, typename Traits, typename Alloc>
+struct MsgSerializeTrait<std::basic_string<CharT, Traits, Alloc> >
+{
+	static const bool enabled = true;
+	static void write(const std::basic_string<CharT, Traits, Alloc> &s, std::string &out) { out.append((const char *)s.data(), s.size() * sizeof(CharT)); }
+	static std::basic_string<CharT, Traits, Alloc> read(const char *data, size_t len)
+	{
+		std::basic_string<CharT, Traits, Alloc> s(len / sizeof(CharT), CharT());
+		memcpy(&s[0], data, s.size() * sizeof(CharT));
+		return s;
+	}
+};
+
+template <typename T, typename Alloc>
+struct MsgSerializeTrait<std::vector<T, Alloc>, typename std::enable_if<std::is_trivially_copyable<T>::value && std::is_default_constructible<T>::value>::type>
+{
+	static const bool enabled = true;
+	static void write(const std::vector<T, Alloc> &v, std::string &out) { out.append((const char *)v.data(), v.size() * sizeof(T)); }
+	static std::vector<T, Alloc> read(const char *data, size_t len)
+	{
+		std::vector<T, Alloc> v(len / sizeof(T));
+		memcpy(v.data(), data, v.size() * sizeof(T));
+		return v;
+	}
+};
+
+//only takes the address of M::load when the payload is serializable
+template <bool ENABLED>
+struct MsgLoaderOf
+{
+	template <typename M>
+	static MsgLoader get() { return nullptr; }
+};
+
+template <>
+struct MsgLoaderOf<true>
+{
+	template <typename M>
+	static MsgLoader get() { return &M::load; }
+};
+
 template <typename MSG_CONTENT_TYPE>
 class Msg : public BaseMsg
 {
@@ -48,6 +321,11 @@ public:
 																		content(content_)
 	{
 	}
+	//also the way to publish move-only payloads such as std::unique_ptr buffers
+	explicit Msg(MSG_CONTENT_TYPE &&content_, int _priority = 0) : BaseMsg(_priority),
+																   content(std::move(content_))
+	{
+	}
 	Msg(const Msg &msg) : content(msg.content)
 	{
 	}
@@ -56,9 +334,104 @@ public:
 	}
 	MSG_CONTENT_TYPE getContent() { return content; }
 
+	//no copy, and the only way to read a move-only payload in a shared subscription
+	const MSG_CONTENT_TYPE &getContentRef() const { return content; }
+
+	//move the payload out; only for the sole owner of the message, see OwnedSubCallback
+	MSG_CONTENT_TYPE takeContent() { return std::move(content); }
+
+	//swap the payload of a message that is still queued, keeping its place; false once it was
+	//dequeued or cancelled. The budgets stay charged with the original size.
+	bool replace(const MSG_CONTENT_TYPE &content_)
+	{
+		if (!lockPending())
+			return false;
+		content = content_;
+		unlockPending();
+		return true;
+	}
+
+	bool replace(MSG_CONTENT_TYPE &&content_)
+	{
+		if (!lockPending())
+			return false;
+		content = std::move(content_);
+		unlockPending();
+		return true;
+	}
+
+	virtual size_t byteSize() const
+	{
+		return sizeof(Msg) + MsgSizeTrait<MSG_CONTENT_TYPE>::size(content);
+	}
+
+	virtual bool serialize(std::string &out) const
+	{
+		return write<MSG_CONTENT_TYPE>(out);
+	}
+
+	virtual MsgLoader loader() const
+	{
+		return MsgLoaderOf<MsgSerializeTrait<MSG_CONTENT_TYPE>::enabled>::template get<Msg>();
+	}
+
+	static BaseMsgPtr load(const char *data, size_t len, int priority)
+	{
+		return BaseMsgPtr(new Msg(MsgSerializeTrait<MSG_CONTENT_TYPE>::read(data, len), priority));
+	}
+
+private:
+	template <typename T>
+	typename std::enable_if<MsgSerializeTrait<T>::enabled, bool>::type write(std::string &out) const
+	{
+		MsgSerializeTrait<T>::write(content, out);
+		return true;
+	}
+
+	template <typename T>
+	typename std::enable_if<!MsgSerializeTrait<T>::enabled, bool>::type write(std::string &) const
+	{
+		return false;
+	}
+
 protected:
 	MSG_CONTENT_TYPE content;
 };
 
 template <typename T>
-using MsgPtr = std::shared_ptr<Msg<T>>;
\ No newline at end of file
+using MsgPtr = std::shared_ptr<Msg<T>>;
+
+//Returned through ThreadSafeMsgQueue::publish() to withdraw or update a message that is still
+//queued. Both are O(1): cancel leaves a tombstone the queue skips, replace rewrites the payload
+//in place. They fail once a dispatcher has dequeued the message.
+template <typename T>
+class MsgHandle
+{
+public:
+	MsgHandle() {}
+	explicit MsgHandle(const MsgPtr<T> &_msg) : msg(_msg) {}
+
+	bool cancel()
+	{
+		return msg && msg->cancel();
+	}
+
+	bool replace(const T &content)
+	{
+		return msg && msg->replace(content);
+	}
+
+	bool replace(T &&content)
+	{
+		return msg && msg->replace(std::move(content));
+	}
+
+	//still queued, neither dequeued nor cancelled
+	bool pending() const
+	{
+		return msg && msg->pending();
+	}
+
+private:
+	MsgPtr<T> msg;
+};
\ No newline at end of file
@@ -0,0 +1,55 @@
+#pragma once
+#include "Msg.h"
+#include <vector>
+
+class MsgHistory;
+using MsgHistoryPtr = std::shared_ptr<MsgHistory>;
+
+//Ring of the last depth dispatched messages of a topic. It only holds references, so keeping
+//history costs no payload copies; late subscribers get a replay of it on subscribe.
+class MsgHistory
+{
+public:
+	explicit MsgHistory(size_t _depth) : ring(_depth), next(0), count(0)
+	{
+	}
+	~MsgHistory()
+	{
+	}
+
+	void push(const BaseMsgPtr &msg)
+	{
+		if (ring.empty())
+			return;
+		ring[next] = msg;
+		next = (next + 1) % ring.size();
+		if (count < ring.size())
+			++count;
+	}
+
+	//oldest first
+	std::vector<BaseMsgPtr> snapshot() const
+	{
+		std::vector<BaseMsgPtr> result;
+		result.reserve(count);
+		size_t first = (next + ring.size() - count) % (ring.empty() ? 1 : ring.size());
+		for (size_t i = 0; i < count; ++i)
+			result.push_back(ring[(first + i) % ring.size()]);
+		return result;
+	}
+
+	size_t depth() const
+	{
+		return ring.size();
+	}
+
+	size_t size() const
+	{
+		return count;
+	}
+
+private:
+	std::vector<BaseMsgPtr> ring;
+	size_t next;
+	size_t count;
+};
@@ -0,0 +1,233 @@
+#pragma once
+#include "Msg.h"
+#include "HugePages.h"
+#include <mutex>
+#include <vector>
+#include <new>
+
+class FixedBlockPool;
+using FixedBlockPoolPtr = std::shared_ptr<FixedBlockPool>;
+
+//Preallocated blocks of one size behind a free list. Requests that do not fit a block, or arrive
+//while the pool is empty, fall back to operator new and are counted as misses. With huge_pages
+//the arenas are 2 MiB-page mappings, so a large pool spans few TLB entries.
+class FixedBlockPool
+{
+public:
+	FixedBlockPool(size_t _block_size, size_t count, bool _huge_pages = false) : block_size((_block_size + 15) & ~(size_t)15),
+																			   huge_pages(_huge_pages),
+																			   free_list(nullptr),
+																			   free_count(0),
+																			   miss_count(0)
+	{
+		reserve(count);
+	}
+	~FixedBlockPool()
+	{
+		for (size_t i = 0; i < arenas.size(); ++i)
+		{
+			if (arenas[i].mapped)
+				hugepage::unmap(arenas[i].base, arenas[i].bytes);
+			else
+				::operator delete(arenas[i].base);
+		}
+	}
+	FixedBlockPool(const FixedBlockPool &) = delete;
+	FixedBlockPool &operator=(const FixedBlockPool &) = delete;
+
+	//add count blocks in one contiguous arena
+	void reserve(size_t count)
+	{
+		if (!count)
+			return;
+		Arena arena;
+		arena.bytes = block_size * count;
+		arena.base = huge_pages ? (char *)hugepage::map(arena.bytes) : nullptr;
+		arena.mapped = arena.base != nullptr;
+		if (arena.mapped)
+		{
+			//the mapping is rounded up to whole huge pages; use all of it
+			arena.bytes = hugepage::roundUp(arena.bytes) / block_size * block_size;
+			count = arena.bytes / block_size;
+		}
+		else
+		{
+			arena.base = (char *)::operator new(arena.bytes);
+		}
+		std::lock_guard<std::mutex> lg(mtx);
+		arenas.push_back(arena);
+		for (size_t i = count; i-- > 0;)
+		{
+			Node *node = (Node *)(arena.base + i * block_size);
+			node->next = free_list;
+			free_list = node;
+		}
+		free_count += count;
+	}
+
+	void *allocate(size_t bytes)
+	{
+		{
+			std::lock_guard<std::mutex> lg(mtx);
+			if (bytes <= block_size && free_list)
+			{
+				Node *node = free_list;
+				free_list = node->next;
+				--free_count;
+				return node;
+			}
+			++miss_count;
+		}
+		return ::operator new(bytes);
+	}
+
+	void deallocate(void *p)
+	{
+		{
+			std::lock_guard<std::mutex> lg(mtx);
+			for (size_t i = 0; i < arenas.size(); ++i)
+			{
+				if ((char *)p >= arenas[i].base && (char *)p < arenas[i].base + arenas[i].bytes)
+				{
+					Node *node = (Node *)p;
+					node->next = free_list;
+					free_list = node;
+					++free_count;
+					return;
+				}
+			}
+		}
+		::operator delete(p);
+	}
+
+	size_t blockSize() const
+	{
+		return block_size;
+	}
+
+	size_t available()
+	{
+		std::lock_guard<std::mutex> lg(mtx);
+		return free_count;
+	}
+
+	//allocations served by operator new instead of the pool
+	size_t misses()
+	{
+		std::lock_guard<std::mutex> lg(mtx);
+		return miss_count;
+	}
+
+	//touch every arena page so first use does not fault
+	void prefault()
+	{
+		std::lock_guard<std::mutex> lg(mtx);
+		for (size_t i = 0; i < arenas.size(); ++i)
+		{
+			for (size_t off = 0; off < arenas[i].bytes; off += 4096)
+				*(volatile char *)(arenas[i].base + off) = *(volatile char *)(arenas[i].base + off);
+		}
+	}
+
+private:
+	struct Node
+	{
+		Node *next;
+	};
+
+	struct Arena
+	{
+		char *base;
+		size_t bytes;
+		bool mapped;
+	};
+
+private:
+	std::mutex mtx;
+	size_t block_size;
+	bool huge_pages;
+	Node *free_list;
+	size_t free_count;
+	size_t miss_count;
+	std::vector<Arena> arenas;
+};
+
+//std allocator over a FixedBlockPool; used with std::allocate_shared so the control block and
+//the message share one pooled block.
+template <typename T>
+class PoolAllocator
+{
+public:
+	typedef T value_type;
+
+	explicit PoolAllocator(FixedBlockPoolPtr _pool) : pool(_pool) {}
+	template <typename U>
+	PoolAllocator(const PoolAllocator<U> &other) : pool(other.pool) {}
+
+	T *allocate(size_t n)
+	{
+		return (T *)pool->allocate(n * sizeof(T));
+	}
+
+	void deallocate(T *p, size_t)
+	{
+		pool->deallocate(p);
+	}
+
+	template <typename U>
+	struct rebind
+	{
+		typedef PoolAllocator<U> other;
+	};
+
+	template <typename U>
+	bool operator==(const PoolAllocator<U> &other) const
+	{
+		return pool == other.pool;
+	}
+
+	template <typename U>
+	bool operator!=(const PoolAllocator<U> &other) const
+	{
+		return pool != other.pool;
+	}
+
+	FixedBlockPoolPtr pool;
+};
+
+template <typename T>
+class MsgPool;
+template <typename T>
+using MsgPoolPtr = std::shared_ptr<MsgPool<T> >;
+
+//Preallocated Msg<T> storage. make() costs a free-list pop instead of a heap allocation while
+//the pool has blocks; messages may outlive the MsgPool object.
+template <typename T>
+class MsgPool
+{
+public:
+	//room for the shared_ptr control block next to the message
+	static const size_t BLOCK_SIZE = sizeof(Msg<T>) + 64;
+
+	explicit MsgPool(size_t count, bool huge_pages = false) : pool(new FixedBlockPool(BLOCK_SIZE, count, huge_pages))
+	{
+	}
+
+	MsgPtr<T> make(const T &content, int priority = 0)
+	{
+		return std::allocate_shared<Msg<T> >(PoolAllocator<Msg<T> >(pool), content, priority);
+	}
+
+	MsgPtr<T> make(T &&content, int priority = 0)
+	{
+		return std::allocate_shared<Msg<T> >(PoolAllocator<Msg<T> >(pool), std::move(content), priority);
+	}
+
+	FixedBlockPoolPtr blocks() const
+	{
+		return pool;
+	}
+
+private:
+	FixedBlockPoolPtr pool;
+};
@@ -1,53 +1,614 @@
 #pragma once
 #include "Msg.h"
+#include "MemoryBudget.h"
+#include "SpillStore.h"
+#include "ChunkQueue.h"
+#include "DedupFilter.h"
+#include "CoDel.h"
+#include "QueuePolicy.h"
 #include <mutex>
 #include <condition_variable>
-#include <queue>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 
-class MsgQueue;
+template <typename Policy>
+class BasicMsgQueue;
+using MsgQueue = BasicMsgQueue<ThreadedPolicy>;
 using MsgQueuePtr = std::shared_ptr<MsgQueue>;
+//for an event loop that enqueues and dequeues on the same thread
+using SingleThreadedMsgQueue = BasicMsgQueue<SingleThreadedPolicy>;
 
-class MsgQueue : public std::enable_shared_from_this<MsgQueue>
+//what enqueue does when a memory budget is exhausted
+enum class OverflowPolicy
+{
+	Block,		//wait until dequeues free enough bytes
+	DropNewest, //reject the message being enqueued
+	DropOldest, //evict the oldest message (in priority order the lowest, in EdfMsgQueue the least urgent) until the new one fits
+	Spill		//serialize to a SpillStore and page back in order as the queue drains (Block where unsupported)
+};
+
+//how enqueue charges a message to the budgets
+enum class Admission
+{
+	Wait,  //apply the overflow policy, waiting under Block
+	NoWait, //refuse instead of waiting under Block; for threads the queue's own draining depends on
+	Held	//already charged by hold(); the charge moves into the queue, or is undone if msg is refused
+};
+
+//which message DropOldest evicts first: the lowest priority, and of those the oldest
+struct BaseMsgPtrEvictFirst
+{
+	bool operator()(const BaseMsgPtr &a, const BaseMsgPtr &b) const
+	{
+		if (a->getpriority() != b->getpriority())
+			return a->getpriority() < b->getpriority();
+		return a->getseq() < b->getseq();
+	}
+};
+
+//Messages stay in a plain FIFO while they all share one priority; the first message with a
+//different priority migrates the queue to a binary heap, which reverts to FIFO once drained.
+//The FIFO lives in pooled chunks and the heap's buffer is dropped after a drain, so memory
+//taken by a burst is handed back instead of staying reserved at its peak.
+//Locking, waiting, counters, clock and heap container come from Policy, see QueuePolicy.h.
+template <typename Policy>
+class BasicMsgQueue : public std::enable_shared_from_this<BasicMsgQueue<Policy> >
 {
 public:
-	MsgQueue()
+	typedef typename Policy::Mutex Mutex;
+	typedef typename Policy::Condition Condition;
+	typedef typename Policy::Container Container;
+	template <typename T>
+	using Atomic = typename Policy::template Atomic<T>;
+
+	BasicMsgQueue() : last_sojourn(0),
+				 budget(new MemoryBudget()),
+				 policy(OverflowPolicy::Block),
+				 drop_count(0),
+				 duplicate_count(0),
+				 mark_count(0),
+				 miss_count(0),
+				 cancel_count(0),
+				 aqm_mark(false),
+				 aqm_enabled(false),
+				 heap_mode(false),
+				 fifo_priority(0),
+				 next_seq(0),
+				 heap_retain(MsgChunk::CAPACITY),
+				 spill_dir(SpillStore::defaultDir())
 	{
 	}
-	~MsgQueue()
+	virtual ~BasicMsgQueue()
 	{
 	}
 
-	void enqueue(BaseMsgPtr msg)
+	static int64_t now()
 	{
-		std::lock_guard<std::mutex> lg(mtx);
-		typedef std::chrono::time_point<std::chrono::system_clock, std::chrono::microseconds> MicroClock_Type;
-        MicroClock_Type now = std::chrono::time_point_cast<std::chrono::microseconds>(std::chrono::system_clock::now());
-        msg->settimestamp(now.time_since_epoch().count());
-		msg_queue_.push(msg);
+		return Policy::Clock::now();
+	}
+
+	//false when the overflow policy dropped the message
+	virtual bool enqueue(BaseMsgPtr msg, Admission admission = Admission::Wait)
+	{
+		if (isDuplicate(msg))
+			return refuse(msg, admission);
+		if (policy == OverflowPolicy::Spill)
+			return enqueueOrSpill(msg, admission);
+		if (!admit(msg, admission))
+		{
+			forgetId(msg);
+			return false;
+		}
+		std::lock_guard<Mutex> lg(mtx);
+		msg->settimestamp(now());
+		msg->setseq(next_seq++);
+		push(msg);
 		cv.notify_all();
+		return true;
 	}
 
-	BaseMsgPtr dequeue()
+	virtual BaseMsgPtr dequeue()
 	{
-		std::lock_guard<std::mutex> lg(mtx);
-		if (msg_queue_.empty())
-			return nullptr;
-		auto result = msg_queue_.top();
-		msg_queue_.pop();
-		return result;
+		std::lock_guard<Mutex> lg(mtx);
+		return take();
+	}
+
+	//without Condition::can_wait, returns nullptr on an empty queue
+	virtual BaseMsgPtr dequeue_block()
+	{
+		std::unique_lock<Mutex> lg(mtx);
+		while (true)
+		{
+			cv.wait(lg, [&] { return !empty(); });
+			BaseMsgPtr result = take();
+			if (result || !Condition::can_wait)
+				return result;
+		}
+	}
+
+	//appends up to max messages to out under a single lock; returns how many
+	virtual size_t dequeue_batch(std::vector<BaseMsgPtr> &out, size_t max)
+	{
+		std::lock_guard<Mutex> lg(mtx);
+		size_t n = 0;
+		for (; n < max; ++n)
+		{
+			BaseMsgPtr msg = take();
+			if (!msg)
+				break;
+			out.push_back(msg);
+		}
+		return n;
+	}
+
+	virtual size_t size()
+	{
+		std::lock_guard<Mutex> lg(mtx);
+		return (heap_mode ? heap.size() : fifo.size()) + (spilled ? spilled->size() : 0);
+	}
+
+	bool isHeap()
+	{
+		std::lock_guard<Mutex> lg(mtx);
+		return heap_mode;
+	}
+
+	//microseconds the last dequeued message waited in the queue
+	int64_t sojourn() const
+	{
+		return last_sojourn;
+	}
+
+	//microseconds the message at the head has waited so far, 0 when empty; unlike sojourn() it
+	//keeps growing while nothing is dequeued
+	virtual int64_t headAge()
+	{
+		std::lock_guard<Mutex> lg(mtx);
+		int64_t timestamp;
+		if (!memoryEmpty())
+			timestamp = (heap_mode ? heap.front() : fifo.front())->gettimestamp();
+		else if (spilled && !spilled->empty())
+			timestamp = spilled->frontTimestamp();
+		else
+			return 0;
+		return now() - timestamp;
+	}
+
+	//limit the bytes held by this queue, 0 = unlimited
+	void setBudget(size_t bytes, OverflowPolicy _policy = OverflowPolicy::Block)
+	{
+		policy = _policy;
+		budget->setLimit(bytes);
+	}
+
+	//broker-wide budget charged in addition to the queue's own
+	void setGlobalBudget(MemoryBudgetPtr _global_budget)
+	{
+		global_budget = _global_budget;
+	}
+
+	size_t usedBytes() const
+	{
+		return budget->used();
+	}
+
+	//charge msg to the budgets while it waits outside the queue, e.g. held back by a rate
+	//limit; false when it does not fit, whatever the overflow policy
+	bool hold(const BaseMsgPtr &msg)
+	{
+		size_t bytes = msg->byteSize();
+		msg->setbytes(bytes);
+		return tryCharge(bytes);
+	}
+
+	//undo hold() before msg is enqueued or discarded
+	void unhold(const BaseMsgPtr &msg)
+	{
+		release(msg);
+	}
+
+	uint64_t dropped() const
+	{
+		return drop_count;
+	}
+
+	//preallocate room for messages so enqueue does not allocate until more are queued;
+	//huge_pages puts the FIFO chunks on 2 MiB pages
+	virtual void reserve(size_t messages, bool huge_pages = false)
+	{
+		std::lock_guard<Mutex> lg(mtx);
+		fifo.reserve(messages, huge_pages);
+		heap.reserve(messages);
+		heap_retain = (std::max)(heap_retain, messages);
+	}
+
+	//touch reserved heap storage so its first use does not page fault; FIFO chunks are
+	//already touched when reserve() builds them
+	virtual void prefault()
+	{
+		std::lock_guard<Mutex> lg(mtx);
+		touch(heap.data(), heap.capacity() * sizeof(BaseMsgPtr));
+	}
+
+	//Allocate the queue's own containers from resource (nullptr = operator new); only while the
+	//queue is empty. FIFO chunks keep coming from the shared ChunkPool, and messages from whoever
+	//created them, see makeMsg().
+	virtual bool setMemoryResource(MemoryResourcePtr resource)
+	{
+		std::lock_guard<Mutex> lg(mtx);
+		if (!empty())
+			return false;
+		Container fresh((ResourceAllocator<BaseMsgPtr>(resource)));
+		fresh.reserve(heap.capacity());
+		heap.swap(fresh);
+		return true;
+	}
+
+	//spare FIFO chunks kept past a drain, and heap slots kept when the heap empties
+	void setRetention(size_t spare_chunks, size_t heap_slots)
+	{
+		std::lock_guard<Mutex> lg(mtx);
+		fifo.setSpareLimit(spare_chunks);
+		heap_retain = heap_slots;
+	}
+
+	//reject messages whose id was already enqueued within the filter's window; nullptr disables
+	void setDedup(DedupFilterPtr _dedup)
+	{
+		std::lock_guard<Mutex> lg(mtx);
+		dedup = _dedup;
+	}
+
+	uint64_t duplicates() const
+	{
+		return duplicate_count;
 	}
 
-	BaseMsgPtr dequeue_block()
+	//CoDel on dequeue: once messages have waited longer than target_us for a whole interval_us,
+	//drop them from the head (counted in dropped()), or with mark deliver them with
+	//BaseMsg::getmarked() set so consumers can shed load themselves. target_us 0 disables.
+	void setAqm(int64_t target_us, int64_t interval_us = 100000, bool mark = false)
 	{
-		std::unique_lock<std::mutex> lg(mtx);
-		cv.wait(lg, [&] { return !msg_queue_.empty(); });
-		auto result = msg_queue_.top();
-		msg_queue_.pop();
+		std::lock_guard<Mutex> lg(mtx);
+		aqm.configure(target_us, interval_us);
+		aqm_mark = mark;
+		aqm_enabled = aqm.enabled();
+	}
+
+	//messages marked by the AQM
+	uint64_t marked() const
+	{
+		return mark_count;
+	}
+
+	//messages dequeued after their deadline, delivered or dropped (EdfMsgQueue)
+	uint64_t missed() const
+	{
+		return miss_count;
+	}
+
+	//cancelled messages discarded on dequeue, see MsgHandle
+	uint64_t cancelled() const
+	{
+		return cancel_count;
+	}
+
+	//where OverflowPolicy::Spill creates its segment files
+	void setSpillDirectory(const std::string &dir)
+	{
+		std::lock_guard<Mutex> lg(mtx);
+		spill_dir = dir;
+	}
+
+	//bytes of queued messages currently held on disk
+	size_t spilledBytes()
+	{
+		std::lock_guard<Mutex> lg(mtx);
+		return spilled ? spilled->diskBytes() : 0;
+	}
+
+protected:
+	bool isDuplicate(const BaseMsgPtr &msg)
+	{
+		if (!msg->getid())
+			return false;
+		DedupFilterPtr filter;
+		{
+			std::lock_guard<Mutex> lg(mtx);
+			filter = dedup;
+		}
+		if (!filter || filter->admit(msg->getid(), now()))
+			return false;
+		++duplicate_count;
+		return true;
+	}
+
+	//undo isDuplicate()'s record of msg's id when msg is dropped, so a retry is not suppressed
+	void forgetId(const BaseMsgPtr &msg)
+	{
+		if (!msg->getid())
+			return;
+		DedupFilterPtr filter;
+		{
+			std::lock_guard<Mutex> lg(mtx);
+			filter = dedup;
+		}
+		if (filter)
+			filter->forget(msg->getid());
+	}
+
+	//charge msg to the budgets, applying the overflow policy; false drops msg. With
+	//Admission::NoWait, or without Condition::can_wait where no dequeue could ever free the
+	//bytes, Block (and Spill where it gets here) refuse the message like DropNewest.
+	bool admit(const BaseMsgPtr &msg, Admission admission = Admission::Wait)
+	{
+		if (admission == Admission::Held)
+			return true;
+		size_t bytes = msg->byteSize();
+		msg->setbytes(bytes);
+		OverflowPolicy current = policy;
+		bool wait = admission == Admission::Wait && Condition::can_wait;
+		if ((current == OverflowPolicy::Block || current == OverflowPolicy::Spill) && wait)
+		{
+			budget->acquire(bytes);
+			if (global_budget)
+				global_budget->acquire(bytes);
+			return true;
+		}
+		while (true)
+		{
+			if (tryCharge(bytes))
+				return true;
+			++drop_count;
+			if (current != OverflowPolicy::DropOldest || !evict())
+				return false;
+		}
+	}
+
+	static void touch(const void *base, size_t bytes)
+	{
+		for (size_t off = 0; off < bytes; off += 4096)
+			*((volatile char *)base + off) = *((volatile char *)base + off);
+	}
+
+	//false, undoing the charge of a message enqueued with Admission::Held
+	bool refuse(const BaseMsgPtr &msg, Admission admission)
+	{
+		if (admission == Admission::Held)
+			release(msg);
+		return false;
+	}
+
+	//make room under DropOldest: drop the FIFO's head, or in heap mode the message
+	//BaseMsgPtrEvictFirst picks; false once nothing is left
+	virtual bool evict()
+	{
+		std::lock_guard<Mutex> lg(mtx);
+		if (memoryEmpty())
+			return false;
+		if (!heap_mode)
+			return (bool)pop();
+		auto victim = std::min_element(heap.begin(), heap.end(), BaseMsgPtrEvictFirst());
+		BaseMsgPtr msg = std::move(*victim);
+		heap.erase(victim);
+		std::make_heap(heap.begin(), heap.end(), BaseMsgPtrCompareLess());
+		if (heap.empty())
+			heap_mode = false;
+		release(msg);
+		return true;
+	}
+
+	//charge both budgets or neither
+	bool tryCharge(size_t bytes)
+	{
+		if (!budget->tryAcquire(bytes))
+			return false;
+		if (!global_budget || global_budget->tryAcquire(bytes))
+			return true;
+		budget->release(bytes);
+		return false;
+	}
+
+	void forceCharge(size_t bytes)
+	{
+		budget->charge(bytes);
+		if (global_budget)
+			global_budget->charge(bytes);
+	}
+
+	void release(const BaseMsgPtr &msg)
+	{
+		budget->release(msg->getbytes());
+		if (global_budget)
+			global_budget->release(msg->getbytes());
+	}
+
+	//apply the AQM to a message just dequeued with its sojourn; true when it was dropped.
+	//Caller holds mtx.
+	bool aqmDrop(const BaseMsgPtr &msg, int64_t sojourn_us, bool empty_after)
+	{
+		if (!aqm.enabled() || !aqm.onDequeue(sojourn_us, now(), empty_after))
+			return false;
+		if (aqm_mark)
+		{
+			msg->setmarked(true);
+			++mark_count;
+			return false;
+		}
+		++drop_count;
+		return true;
+	}
+
+private:
+	bool empty() const
+	{
+		return memoryEmpty() && (!spilled || spilled->empty());
+	}
+
+	bool memoryEmpty() const
+	{
+		return heap_mode ? heap.empty() : fifo.empty();
+	}
+
+	//pop, skipping cancelled messages and those the AQM drops; nullptr once empty
+	BaseMsgPtr take()
+	{
+		while (!empty())
+		{
+			BaseMsgPtr msg = pop();
+			if (!msg->claim())
+			{
+				++cancel_count;
+				continue;
+			}
+			if (!aqmDrop(msg, last_sojourn, empty()))
+				return msg;
+		}
+		return nullptr;
+	}
+
+	//once anything is on disk, later messages follow it there to keep FIFO order; one that cannot
+	//be spilled then is dropped rather than overtaking them
+	bool enqueueOrSpill(const BaseMsgPtr &msg, Admission admission)
+	{
+		bool held = admission == Admission::Held;
+		size_t bytes = held ? msg->getbytes() : msg->byteSize();
+		msg->setbytes(bytes);
+		std::unique_lock<Mutex> lg(mtx);
+		msg->settimestamp(now());
+		msg->setseq(next_seq++);
+		bool behind_disk = spilled && !spilled->empty();
+		if (behind_disk || !(held || tryCharge(bytes)))
+		{
+			//spilled messages are charged again when paged back in
+			if (held)
+				release(msg);
+			if (!spilled)
+				spilled.reset(new SpillStore(spill_dir));
+			//what comes back from disk is a new message a handle can no longer reach, so claim it
+			//before serializing: a racing cancel or replace then either makes it to disk or fails
+			if (!msg->claim())
+			{
+				++cancel_count;
+				return true;
+			}
+			if (spilled->push(msg))
+			{
+				cv.notify_all();
+				return true;
+			}
+			if (behind_disk)
+			{
+				++drop_count;
+				lg.unlock();
+				forgetId(msg);
+				return false;
+			}
+			//no serializer for this payload and nothing to overtake: keep it in memory, over budget
+			forceCharge(bytes);
+		}
+		push(msg);
+		cv.notify_all();
+		return true;
+	}
+
+	//move spilled messages back while they fit the budgets; force loads at least one
+	void pageIn(bool force)
+	{
+		while (spilled && !spilled->empty())
+		{
+			size_t bytes = spilled->frontBytes();
+			if (!tryCharge(bytes))
+			{
+				if (!force)
+					break;
+				forceCharge(bytes);
+			}
+			push(spilled->pop());
+			force = false;
+		}
+	}
+
+	void push(const BaseMsgPtr &msg)
+	{
+		if (!heap_mode)
+		{
+			if (fifo.empty() || msg->getpriority() == fifo_priority)
+			{
+				fifo_priority = msg->getpriority();
+				fifo.push_back(msg);
+				return;
+			}
+			//equal priorities in ascending seq are already ordered best-first, which is a valid heap
+			heap.reserve(fifo.size() + 1);
+			while (!fifo.empty())
+			{
+				heap.push_back(std::move(fifo.front()));
+				fifo.pop_front();
+			}
+			heap_mode = true;
+		}
+		heap.push_back(msg);
+		std::push_heap(heap.begin(), heap.end(), BaseMsgPtrCompareLess());
+	}
+
+	BaseMsgPtr pop()
+	{
+		if (memoryEmpty())
+			pageIn(true);
+		BaseMsgPtr result;
+		if (heap_mode)
+		{
+			std::pop_heap(heap.begin(), heap.end(), BaseMsgPtrCompareLess());
+			result = std::move(heap.back());
+			heap.pop_back();
+			if (heap.empty())
+			{
+				heap_mode = false;
+				if (heap.capacity() > heap_retain)
+					Container(heap.get_allocator()).swap(heap);
+			}
+		}
+		else
+		{
+			result = std::move(fifo.front());
+			fifo.pop_front();
+		}
+		last_sojourn = now() - result->gettimestamp();
+		release(result);
+		if (spilled && !spilled->empty())
+			pageIn(false);
 		return result;
 	}
 
+protected:
+	Mutex mtx;
+	Condition cv;
+	Atomic<int64_t> last_sojourn;
+	MemoryBudgetPtr budget;
+	MemoryBudgetPtr global_budget;
+	//set by setBudget() while publishers read it
+	Atomic<OverflowPolicy> policy;
+	Atomic<uint64_t> drop_count;
+	Atomic<uint64_t> duplicate_count;
+	Atomic<uint64_t> mark_count;
+	Atomic<uint64_t> miss_count;
+	Atomic<uint64_t> cancel_count;
+	CoDel aqm;
+	bool aqm_mark;
+	//readable without mtx, for subclasses whose dequeue does not take it
+	Atomic<bool> aqm_enabled;
+	DedupFilterPtr dedup;
+
 private:
-	std::priority_queue<BaseMsgPtr, std::vector<BaseMsgPtr>, BaseMsgPtrCompareLess> msg_queue_;
-	std::mutex mtx;
-	std::condition_variable cv;
+	bool heap_mode;
+	int fifo_priority;
+	uint64_t next_seq;
+	ChunkQueue fifo;
+	Container heap;
+	size_t heap_retain;
+	std::string spill_dir;
+	SpillStorePtr spilled;
 };
@@ -0,0 +1,111 @@
+#pragma once
+#include "MemoryResource.h"
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+
+using MsgVector = std::vector<BaseMsgPtr, ResourceAllocator<BaseMsgPtr> >;
+
+//Lock for code that only ever runs on one thread; satisfies std::lock_guard and std::unique_lock.
+struct NullMutex
+{
+	void lock() {}
+	void unlock() {}
+	bool try_lock() { return true; }
+};
+
+//Wait policy over std::mutex
+struct CondVar : public std::condition_variable
+{
+	static const bool can_wait = true;
+};
+
+//Wait policy matching NullMutex. No other thread can make a predicate true, so wait returns at
+//once and blocking calls check can_wait to return empty-handed instead of spinning.
+struct NullCondition
+{
+	static const bool can_wait = false;
+	template <typename Lock, typename Predicate>
+	void wait(Lock &, Predicate) {}
+	void notify_one() {}
+	void notify_all() {}
+};
+
+//std::atomic's interface, as far as the queues use it, over a plain value
+template <typename T>
+class Unsynchronized
+{
+public:
+	Unsynchronized(T _value = T()) : value(_value) {}
+	operator T() const { return value; }
+	Unsynchronized &operator=(T _value)
+	{
+		value = _value;
+		return *this;
+	}
+	T operator++() { return ++value; }
+	T load(std::memory_order = std::memory_order_seq_cst) const { return value; }
+	void store(T _value, std::memory_order = std::memory_order_seq_cst) { value = _value; }
+	T fetch_add(T n, std::memory_order = std::memory_order_seq_cst)
+	{
+		T old = value;
+		value += n;
+		return old;
+	}
+	T fetch_sub(T n, std::memory_order = std::memory_order_seq_cst)
+	{
+		T old = value;
+		value -= n;
+		return old;
+	}
+
+private:
+	T value;
+};
+
+//microseconds since the epoch; what message timestamps and deadlines have always used
+struct SystemMicroClock
+{
+	static int64_t now()
+	{
+		return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+	}
+};
+
+//microseconds on a clock that never jumps, for deployments that do not compare timestamps across hosts
+struct SteadyMicroClock
+{
+	static int64_t now()
+	{
+		return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+};
+
+//Compile-time configuration of BasicMsgQueue and BasicThreadSafeMsgQueue: the lock, the wait
+//primitive that goes with it, the counters, the clock and the heap container (allocator-aware
+//with std::vector's interface). Derive from a policy to change one part.
+struct ThreadedPolicy
+{
+	typedef std::mutex Mutex;
+	typedef CondVar Condition;
+	template <typename T>
+	using Atomic = std::atomic<T>;
+	typedef SystemMicroClock Clock;
+	typedef MsgVector Container;
+};
+
+//Event-loop-only use: publish, dispatch and dequeue all on one thread. The queue's and the
+//broker's locks, condition variables and counters compile to plain code; MemoryBudget's
+//atomics, the shared ChunkPool's mutex, BaseMsg's cancel state and the thread_local dispatch
+//context stay synchronized. Blocking calls return instead of waiting, and a Block budget
+//refuses what does not fit.
+struct SingleThreadedPolicy
+{
+	typedef NullMutex Mutex;
+	typedef NullCondition Condition;
+	template <typename T>
+	using Atomic = Unsynchronized<T>;
+	typedef SystemMicroClock Clock;
+	typedef MsgVector Container;
+};
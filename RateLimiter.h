@@ -0,0 +1,128 @@
+#pragma once
+#include <memory>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <cstdint>
+#include <algorithm>
+
+//what happens to a message over its rate limit
+enum class RateLimitPolicy
+{
+	Drop,  //publish() returns false
+	Block, //publish() sleeps until the message conforms
+	Delay  //publish() returns at once; the message is queued when it conforms
+};
+
+class RateLimiter;
+using RateLimiterPtr = std::shared_ptr<RateLimiter>;
+
+//Token bucket in its GCRA form: the bucket is a single atomic "theoretical arrival time", so
+//a check is one load, a compare and one CAS, without locks. rate is messages per second and
+//burst how many may arrive back to back; rate 0 lets everything through.
+class RateLimiter
+{
+public:
+	explicit RateLimiter(double rate = 0, double burst = 1, RateLimitPolicy policy = RateLimitPolicy::Drop) : interval_ns(0),
+																											 tolerance_ns(0),
+																											 limit_policy((int)policy),
+																											 tat(0),
+																											 limited_count(0)
+	{
+		configure(rate, burst, policy);
+	}
+
+	void configure(double rate, double burst, RateLimitPolicy policy)
+	{
+		int64_t interval = 0;
+		if (rate > 0)
+			interval = (std::max)((int64_t)(1e9 / rate), (int64_t)1);
+		interval_ns = interval;
+		tolerance_ns = (int64_t)(interval * ((std::max)(burst, 1.0) - 1));
+		limit_policy = (int)policy;
+	}
+
+	static int64_t now()
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	bool unlimited() const
+	{
+		return interval_ns.load(std::memory_order_relaxed) == 0;
+	}
+
+	RateLimitPolicy policy() const
+	{
+		return (RateLimitPolicy)limit_policy.load(std::memory_order_relaxed);
+	}
+
+	//take a token if one is available now
+	bool tryAcquire(int64_t now_ns)
+	{
+		int64_t interval = interval_ns.load(std::memory_order_relaxed);
+		if (!interval)
+			return true;
+		int64_t tolerance = tolerance_ns.load(std::memory_order_relaxed);
+		int64_t t = tat.load(std::memory_order_relaxed);
+		while (true)
+		{
+			int64_t base = (std::max)(t, now_ns);
+			if (base - now_ns > tolerance)
+			{
+				limited_count.fetch_add(1, std::memory_order_relaxed);
+				return false;
+			}
+			if (tat.compare_exchange_weak(t, base + interval, std::memory_order_relaxed))
+				return true;
+		}
+	}
+
+	//take the next token whenever it comes; returns the time it is due (<= now_ns if available now)
+	int64_t reserve(int64_t now_ns)
+	{
+		int64_t interval = interval_ns.load(std::memory_order_relaxed);
+		if (!interval)
+			return now_ns;
+		int64_t tolerance = tolerance_ns.load(std::memory_order_relaxed);
+		int64_t t = tat.load(std::memory_order_relaxed);
+		while (true)
+		{
+			int64_t base = (std::max)(t, now_ns);
+			if (tat.compare_exchange_weak(t, base + interval, std::memory_order_relaxed))
+			{
+				if (base - tolerance > now_ns)
+					limited_count.fetch_add(1, std::memory_order_relaxed);
+				return base - tolerance;
+			}
+		}
+	}
+
+	//give back a token taken by tryAcquire or reserve that ended up unused
+	void refund()
+	{
+		tat.fetch_sub(interval_ns.load(std::memory_order_relaxed), std::memory_order_relaxed);
+	}
+
+	//sleep until a token is available and take it
+	void acquire()
+	{
+		int64_t now_ns = now();
+		int64_t due = reserve(now_ns);
+		if (due > now_ns)
+			std::this_thread::sleep_for(std::chrono::nanoseconds(due - now_ns));
+	}
+
+	//messages that were over the limit (dropped, blocked or delayed)
+	uint64_t limited() const
+	{
+		return limited_count.load(std::memory_order_relaxed);
+	}
+
+private:
+	std::atomic<int64_t> interval_ns;
+	std::atomic<int64_t> tolerance_ns;
+	std::atomic<int> limit_policy;
+	std::atomic<int64_t> tat;
+	std::atomic<uint64_t> limited_count;
+};
@@ -0,0 +1,130 @@
+#pragma once
+#include <atomic>
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <alloca.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+//Helpers for running the broker on real-time threads: lock and prefault memory, set the
+//scheduling class of dispatcher threads, and check that steady-state dispatch does not allocate.
+//
+//Allocation checking needs the replacement operator new in RtAllocHook.h, included by exactly
+//one translation unit; without it NoAllocScope is a no-op and realtime::hooked() returns false.
+namespace realtime
+{
+	struct RealTimeConfig
+	{
+		RealTimeConfig() : lock_memory(true), prefault_stack(256 << 10), prefault_heap(16 << 20) {}
+		//mlockall current and future pages
+		bool lock_memory;
+		//bytes of stack and heap touched up front so they are resident before the loop starts
+		size_t prefault_stack;
+		size_t prefault_heap;
+	};
+
+	inline std::atomic<uint64_t> &violationCounter()
+	{
+		static std::atomic<uint64_t> count(0);
+		return count;
+	}
+
+	inline int &noAllocDepth()
+	{
+		static thread_local int depth = 0;
+		return depth;
+	}
+
+	inline bool &hookFlag()
+	{
+		static bool flag = false;
+		return flag;
+	}
+
+	//true when the allocation hook is linked in
+	inline bool hooked()
+	{
+		return hookFlag();
+	}
+
+	//allocations made inside a NoAllocScope since the process started
+	inline uint64_t violations()
+	{
+		return violationCounter().load();
+	}
+
+	//called by the hooked operator new
+	inline void onAllocation()
+	{
+		if (noAllocDepth())
+		{
+			violationCounter().fetch_add(1, std::memory_order_relaxed);
+			assert(!"allocation inside a realtime::NoAllocScope");
+		}
+	}
+
+	//marks the current thread as being on a path that must not allocate
+	class NoAllocScope
+	{
+	public:
+		NoAllocScope() { ++noAllocDepth(); }
+		~NoAllocScope() { --noAllocDepth(); }
+		NoAllocScope(const NoAllocScope &) = delete;
+		NoAllocScope &operator=(const NoAllocScope &) = delete;
+	};
+
+	inline void prefaultStack(size_t bytes)
+	{
+		char *buffer = (char *)alloca(bytes);
+		for (size_t i = 0; i < bytes; i += 4096)
+			((volatile char *)buffer)[i] = 0;
+	}
+
+	//grow the heap and touch it, keeping it mapped for later allocations
+	inline void prefaultHeap(size_t bytes)
+	{
+#ifdef __GLIBC__
+		mallopt(M_MMAP_MAX, 0);
+		mallopt(M_TRIM_THRESHOLD, -1);
+#endif
+		char *buffer = (char *)malloc(bytes);
+		if (!buffer)
+			return;
+		for (size_t i = 0; i < bytes; i += 4096)
+			((volatile char *)buffer)[i] = 0;
+		free(buffer);
+	}
+
+	inline bool lockMemory()
+	{
+		return mlockall(MCL_CURRENT | MCL_FUTURE) == 0;
+	}
+
+	//false when memory could not be locked (usually missing CAP_IPC_LOCK or RLIMIT_MEMLOCK)
+	inline bool enter(const RealTimeConfig &config = RealTimeConfig())
+	{
+		bool ok = true;
+		if (config.lock_memory)
+			ok = lockMemory();
+		if (config.prefault_heap)
+			prefaultHeap(config.prefault_heap);
+		if (config.prefault_stack)
+			prefaultStack(config.prefault_stack);
+		return ok;
+	}
+
+	//SCHED_FIFO / SCHED_RR / SCHED_OTHER for the calling thread
+	inline bool setThreadScheduling(int policy, int priority)
+	{
+		sched_param param;
+		memset(&param, 0, sizeof(param));
+		param.sched_priority = priority;
+		return pthread_setschedparam(pthread_self(), policy, &param) == 0;
+	}
+}
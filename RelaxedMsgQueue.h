@@ -0,0 +1,247 @@
+#pragma once
+#include "MsgQueue.h"
+#include <thread>
+#include <memory>
+#include <climits>
+
+class RelaxedMsgQueue;
+using RelaxedMsgQueuePtr = std::shared_ptr<RelaxedMsgQueue>;
+
+//MultiQueue: c*P independently locked heaps. enqueue pushes into a random heap, dequeue pops the
+//better top of two random heaps. Order is only approximately by priority, in exchange for
+//throughput that scales with the number of producers and consumers.
+class RelaxedMsgQueue : public MsgQueue
+{
+public:
+	explicit RelaxedMsgQueue(size_t threads = std::thread::hardware_concurrency(), size_t c = 2) : count(0),
+																								  next_seq(0),
+																								  waiters(0)
+	{
+		size_t n = (std::max)((size_t)2, (std::max)(threads, (size_t)1) * (std::max)(c, (size_t)1));
+		for (size_t i = 0; i < n; ++i)
+			heaps.push_back(std::unique_ptr<SubHeap>(new SubHeap()));
+	}
+	~RelaxedMsgQueue()
+	{
+	}
+
+	virtual bool enqueue(BaseMsgPtr msg, Admission admission = Admission::Wait)
+	{
+		if (isDuplicate(msg))
+			return refuse(msg, admission);
+		if (!admit(msg, admission))
+		{
+			forgetId(msg);
+			return false;
+		}
+		msg->settimestamp(now());
+		msg->setseq(next_seq.fetch_add(1, std::memory_order_relaxed));
+		while (true)
+		{
+			SubHeap &h = *heaps[random() % heaps.size()];
+			std::unique_lock<std::mutex> lk(h.mtx, std::try_to_lock);
+			if (!lk.owns_lock())
+				continue;
+			h.heap.push_back(msg);
+			std::push_heap(h.heap.begin(), h.heap.end(), BaseMsgPtrCompareLess());
+			h.top = key(h.heap.front());
+			break;
+		}
+		count.fetch_add(1);
+		if (waiters.load())
+		{
+			std::lock_guard<std::mutex> lg(mtx);
+			cv.notify_one();
+		}
+		return true;
+	}
+
+	virtual BaseMsgPtr dequeue()
+	{
+		while (count.load() > 0)
+		{
+			size_t a = random() % heaps.size();
+			size_t b = random() % heaps.size();
+			if (heaps[b]->top.load(std::memory_order_relaxed) > heaps[a]->top.load(std::memory_order_relaxed))
+				a = b;
+			SubHeap &h = *heaps[a];
+			std::unique_lock<std::mutex> lk(h.mtx, std::try_to_lock);
+			if (!lk.owns_lock() || h.heap.empty())
+				continue;
+			std::pop_heap(h.heap.begin(), h.heap.end(), BaseMsgPtrCompareLess());
+			BaseMsgPtr result = std::move(h.heap.back());
+			h.heap.pop_back();
+			h.top = h.heap.empty() ? 0 : key(h.heap.front());
+			lk.unlock();
+			count.fetch_sub(1);
+			int64_t sojourn = now() - result->gettimestamp();
+			last_sojourn = sojourn;
+			release(result);
+			if (!result->claim())
+			{
+				++cancel_count;
+				continue;
+			}
+			if (aqm_enabled)
+			{
+				std::lock_guard<std::mutex> lg(mtx);
+				if (aqmDrop(result, sojourn, count.load() == 0))
+					continue;
+			}
+			return result;
+		}
+		return nullptr;
+	}
+
+	//heaps are locked one pop at a time, so a batch is just repeated dequeues
+	virtual size_t dequeue_batch(std::vector<BaseMsgPtr> &out, size_t max)
+	{
+		size_t n = 0;
+		for (; n < max; ++n)
+		{
+			BaseMsgPtr msg = dequeue();
+			if (!msg)
+				break;
+			out.push_back(msg);
+		}
+		return n;
+	}
+
+	virtual BaseMsgPtr dequeue_block()
+	{
+		while (true)
+		{
+			BaseMsgPtr result = dequeue();
+			if (result)
+				return result;
+			std::unique_lock<std::mutex> lk(mtx);
+			++waiters;
+			cv.wait(lk, [&] { return count.load() > 0; });
+			--waiters;
+		}
+	}
+
+	//every heap gets room for messages, since enqueue picks heaps at random; the heaps are
+	//plain vectors, so huge_pages has no effect here
+	virtual void reserve(size_t messages, bool = false)
+	{
+		for (size_t i = 0; i < heaps.size(); ++i)
+		{
+			std::lock_guard<std::mutex> lg(heaps[i]->mtx);
+			heaps[i]->heap.reserve(messages);
+		}
+	}
+
+	virtual void prefault()
+	{
+		for (size_t i = 0; i < heaps.size(); ++i)
+		{
+			std::lock_guard<std::mutex> lg(heaps[i]->mtx);
+			touch(heaps[i]->heap.data(), heaps[i]->heap.capacity() * sizeof(BaseMsgPtr));
+		}
+	}
+
+	//fails while any heap holds messages
+	virtual bool setMemoryResource(MemoryResourcePtr resource)
+	{
+		if (count.load() > 0)
+			return false;
+		for (size_t i = 0; i < heaps.size(); ++i)
+		{
+			std::lock_guard<std::mutex> lg(heaps[i]->mtx);
+			if (!heaps[i]->heap.empty())
+				return false;
+			MsgVector fresh((ResourceAllocator<BaseMsgPtr>(resource)));
+			fresh.reserve(heaps[i]->heap.capacity());
+			heaps[i]->heap.swap(fresh);
+		}
+		return true;
+	}
+
+	virtual size_t size()
+	{
+		return (size_t)(std::max)((int64_t)0, count.load());
+	}
+
+	//age of the oldest message on top of any heap
+	virtual int64_t headAge()
+	{
+		int64_t oldest = INT64_MAX;
+		for (size_t i = 0; i < heaps.size(); ++i)
+		{
+			std::lock_guard<std::mutex> lg(heaps[i]->mtx);
+			if (!heaps[i]->heap.empty())
+				oldest = (std::min)(oldest, heaps[i]->heap.front()->gettimestamp());
+		}
+		return oldest == INT64_MAX ? 0 : now() - oldest;
+	}
+
+protected:
+	//DropOldest gives up the lowest priority (then oldest) message of any heap, not the best one
+	virtual bool evict()
+	{
+		BaseMsgPtr worst;
+		size_t chosen = 0;
+		for (size_t i = 0; i < heaps.size(); ++i)
+		{
+			std::lock_guard<std::mutex> lg(heaps[i]->mtx);
+			if (heaps[i]->heap.empty())
+				continue;
+			const BaseMsgPtr &candidate = *std::min_element(heaps[i]->heap.begin(), heaps[i]->heap.end(), BaseMsgPtrEvictFirst());
+			if (!worst || BaseMsgPtrEvictFirst()(candidate, worst))
+			{
+				worst = candidate;
+				chosen = i;
+			}
+		}
+		if (!worst)
+			return false;
+		//the heap may have changed since; take its current worst
+		SubHeap &h = *heaps[chosen];
+		std::unique_lock<std::mutex> lk(h.mtx);
+		if (h.heap.empty())
+			return false;
+		auto victim = std::min_element(h.heap.begin(), h.heap.end(), BaseMsgPtrEvictFirst());
+		BaseMsgPtr msg = std::move(*victim);
+		h.heap.erase(victim);
+		std::make_heap(h.heap.begin(), h.heap.end(), BaseMsgPtrCompareLess());
+		h.top = h.heap.empty() ? 0 : key(h.heap.front());
+		lk.unlock();
+		count.fetch_sub(1);
+		release(msg);
+		return true;
+	}
+
+private:
+	struct SubHeap
+	{
+		SubHeap() : top(0) {}
+		std::mutex mtx;
+		MsgVector heap;
+		//key() of the current top, 0 when empty; read without the lock to pick a heap
+		std::atomic<uint64_t> top;
+		char padding[64];
+	};
+
+	//higher is better: priority in the high word, inverted sequence (older first) in the low word
+	static uint64_t key(const BaseMsgPtr &msg)
+	{
+		uint64_t p = (uint64_t)((int64_t)msg->getpriority() - INT32_MIN);
+		return (p << 32) | (uint32_t)~msg->getseq();
+	}
+
+	static uint64_t random()
+	{
+		static thread_local uint64_t state = std::hash<std::thread::id>()(std::this_thread::get_id()) | 1;
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+		return state;
+	}
+
+private:
+	std::vector<std::unique_ptr<SubHeap> > heaps;
+	std::atomic<int64_t> count;
+	std::atomic<uint64_t> next_seq;
+	std::atomic<int> waiters;
+};
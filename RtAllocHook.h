@@ -0,0 +1,55 @@
+#pragma once
+#include "RealTime.h"
+
+//Replacement global operator new/delete that report allocations made inside a
+//realtime::NoAllocScope. Include from exactly one translation unit of the program. The deletes
+//are kept out of line so the compiler does not pair their free() with an inlined operator new.
+namespace realtime
+{
+	static const bool hook_installed = (hookFlag() = true);
+}
+
+void *operator new(std::size_t size)
+{
+	realtime::onAllocation();
+	void *p = malloc(size ? size : 1);
+	if (!p)
+		throw std::bad_alloc();
+	return p;
+}
+
+void *operator new[](std::size_t size)
+{
+	return operator new(size);
+}
+
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept
+{
+	realtime::onAllocation();
+	return malloc(size ? size : 1);
+}
+
+void *operator new[](std::size_t size, const std::nothrow_t &) noexcept
+{
+	return operator new(size, std::nothrow);
+}
+
+__attribute__((noinline)) void operator delete(void *p) noexcept
+{
+	free(p);
+}
+
+__attribute__((noinline)) void operator delete[](void *p) noexcept
+{
+	free(p);
+}
+
+__attribute__((noinline)) void operator delete(void *p, std::size_t) noexcept
+{
+	free(p);
+}
+
+__attribute__((noinline)) void operator delete[](void *p, std::size_t) noexcept
+{
+	free(p);
+}
@@ -0,0 +1,168 @@
+#pragma once
+#include "Msg.h"
+#include "MsgPool.h"
+#include "HugePages.h"
+#include <atomic>
+#include <new>
+#include <type_traits>
+
+class BaseRtChannel;
+using BaseRtChannelPtr = std::shared_ptr<BaseRtChannel>;
+
+//Consumer side of a real-time publisher, drained by the dispatcher.
+class BaseRtChannel
+{
+public:
+	BaseRtChannel() : draining(false), refuse_count(0) {}
+	virtual ~BaseRtChannel() {}
+
+	//next published value wrapped in a message, nullptr when empty; single consumer only
+	virtual BaseMsgPtr pop() = 0;
+	virtual bool empty() const = 0;
+	virtual size_t capacity() const = 0;
+	//touch the ring and its message pool so the first publishes do not page fault
+	virtual void prefault() = 0;
+
+	//several dispatchers may try to drain; only one at a time gets the consumer side
+	bool tryLock()
+	{
+		return !draining.exchange(true, std::memory_order_acquire);
+	}
+
+	void unlock()
+	{
+		draining.store(false, std::memory_order_release);
+	}
+
+	//values drained from the ring that the topic's queue refused, e.g. over a full budget
+	uint64_t refused() const
+	{
+		return refuse_count.load(std::memory_order_relaxed);
+	}
+
+	void countRefused()
+	{
+		refuse_count.fetch_add(1, std::memory_order_relaxed);
+	}
+
+private:
+	std::atomic<bool> draining;
+	std::atomic<uint64_t> refuse_count;
+};
+
+template <typename T>
+class RtPublisher;
+template <typename T>
+using RtPublisherPtr = std::shared_ptr<RtPublisher<T> >;
+
+//Wait-free single-producer publish for real-time threads. Slots are preallocated, tryPublish()
+//is a bounded copy plus one release store: no lock, syscall or allocation, and it reports a
+//full ring instead of blocking. The dispatcher wraps values into Msg<T> off the real-time path.
+//Each publisher must be used by one producer thread.
+template <typename T>
+class RtPublisher : public BaseRtChannel
+{
+	static_assert(std::is_trivially_copyable<T>::value, "real-time payloads must be trivially copyable so publish never allocates");
+
+public:
+	//huge_pages maps the ring and the message pool on 2 MiB pages (heap when unavailable)
+	explicit RtPublisher(size_t capacity, int _priority = 0, bool huge_pages = false) : priority(_priority), slots(nullptr), mapped(false), head(0), tail(0), cached_head(0), fail_count(0)
+	{
+		size_t n = 1;
+		while (n < capacity)
+			n <<= 1;
+		mask = n - 1;
+		if (huge_pages)
+			slots = (T *)hugepage::map(n * sizeof(T));
+		mapped = slots != nullptr;
+		if (mapped)
+		{
+			for (size_t i = 0; i < n; ++i)
+				new (slots + i) T();
+		}
+		else
+		{
+			slots = new T[n];
+		}
+		pool.reset(new MsgPool<T>(2 * n + 64, huge_pages));
+	}
+	~RtPublisher()
+	{
+		if (mapped)
+			hugepage::unmap(slots, capacity() * sizeof(T));
+		else
+			delete[] slots;
+	}
+	RtPublisher(const RtPublisher &) = delete;
+	RtPublisher &operator=(const RtPublisher &) = delete;
+
+	//false when the ring is full
+	bool tryPublish(const T &value)
+	{
+		size_t t = tail.load(std::memory_order_relaxed);
+		if (t - cached_head > mask)
+		{
+			cached_head = head.load(std::memory_order_acquire);
+			if (t - cached_head > mask)
+			{
+				fail_count.fetch_add(1, std::memory_order_relaxed);
+				return false;
+			}
+		}
+		slots[t & mask] = value;
+		tail.store(t + 1, std::memory_order_release);
+		return true;
+	}
+
+	//publishes that found the ring full
+	uint64_t failed() const
+	{
+		return fail_count.load(std::memory_order_relaxed);
+	}
+
+	virtual size_t capacity() const
+	{
+		return mask + 1;
+	}
+
+	MsgPoolPtr<T> msgPool() const
+	{
+		return pool;
+	}
+
+	virtual void prefault()
+	{
+		for (size_t off = 0; off < capacity() * sizeof(T); off += 4096)
+			*((volatile char *)slots + off) = *((volatile char *)slots + off);
+		pool->blocks()->prefault();
+	}
+
+	virtual bool empty() const
+	{
+		return head.load(std::memory_order_relaxed) == tail.load(std::memory_order_acquire);
+	}
+
+	virtual BaseMsgPtr pop()
+	{
+		size_t h = head.load(std::memory_order_relaxed);
+		if (h == tail.load(std::memory_order_acquire))
+			return nullptr;
+		BaseMsgPtr msg = pool->make(slots[h & mask], priority);
+		head.store(h + 1, std::memory_order_release);
+		return msg;
+	}
+
+private:
+	int priority;
+	MsgPoolPtr<T> pool;
+	T *slots;
+	bool mapped;
+	size_t mask;
+	//consumer index and producer index on separate cache lines
+	char pad0[64];
+	std::atomic<size_t> head;
+	char pad1[64];
+	std::atomic<size_t> tail;
+	size_t cached_head;
+	std::atomic<uint64_t> fail_count;
+};
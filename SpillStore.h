@@ -0,0 +1,202 @@
+#pragma once
+#include "Msg.h"
+#include <deque>
+#include <string>
+#include <cstdio>
+#include <cstdlib>
+#include <atomic>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+class SpillStore;
+using SpillStorePtr = std::shared_ptr<SpillStore>;
+
+//FIFO of serialized messages in memory-mapped segment files. Segments are unlinked as soon
+//as they are created, so nothing is left on disk once the store (or the process) goes away.
+class SpillStore
+{
+public:
+	explicit SpillStore(const std::string &_dir = defaultDir(), size_t _segment_size = 4 << 20) : dir(_dir),
+																								   segment_size(_segment_size),
+																								   spilled_bytes(0)
+	{
+	}
+	~SpillStore()
+	{
+		while (!segments.empty())
+			closeSegment();
+	}
+
+	static std::string defaultDir()
+	{
+		const char *tmp = getenv("TMPDIR");
+		return tmp && *tmp ? tmp : "/tmp";
+	}
+
+	//false when msg has no serializer or the segment cannot be created
+	bool push(const BaseMsgPtr &msg)
+	{
+		MsgLoader loader = msg->loader();
+		if (!loader)
+			return false;
+		scratch.clear();
+		if (!msg->serialize(scratch))
+			return false;
+
+		Header header;
+		header.len = scratch.size();
+		header.priority = msg->getpriority();
+		header.timestamp = msg->gettimestamp();
+		header.seq = msg->getseq();
+		header.id = msg->getid();
+		header.deadline = msg->getdeadline();
+		header.marked = msg->getmarked();
+		size_t need = sizeof(Header) + scratch.size();
+		if (segments.empty() || segments.back().capacity - segments.back().write_off < need)
+		{
+			if (!openSegment((std::max)(segment_size, need)))
+				return false;
+		}
+		Segment &tail = segments.back();
+		memcpy(tail.base + tail.write_off, &header, sizeof(Header));
+		memcpy(tail.base + tail.write_off + sizeof(Header), scratch.data(), scratch.size());
+		tail.write_off += need;
+
+		Entry entry;
+		entry.loader = loader;
+		entry.bytes = msg->getbytes();
+		entry.timestamp = header.timestamp;
+		index.push_back(entry);
+		spilled_bytes += need;
+		return true;
+	}
+
+	BaseMsgPtr pop()
+	{
+		if (index.empty())
+			return nullptr;
+		Segment &head = segments.front();
+		Header header;
+		memcpy(&header, head.base + head.read_off, sizeof(Header));
+		BaseMsgPtr msg = index.front().loader(head.base + head.read_off + sizeof(Header), header.len, header.priority);
+		msg->settimestamp(header.timestamp);
+		msg->setseq(header.seq);
+		msg->setid(header.id);
+		msg->setdeadline(header.deadline);
+		msg->setmarked(header.marked != 0);
+		msg->setbytes(index.front().bytes);
+		index.pop_front();
+
+		size_t used = sizeof(Header) + header.len;
+		head.read_off += used;
+		spilled_bytes -= used;
+		if (head.read_off == head.write_off && (segments.size() > 1 || index.empty()))
+			closeSegment();
+		return msg;
+	}
+
+	bool empty() const
+	{
+		return index.empty();
+	}
+
+	size_t size() const
+	{
+		return index.size();
+	}
+
+	//in-memory footprint of the next message, as charged before it was spilled
+	size_t frontBytes() const
+	{
+		return index.empty() ? 0 : index.front().bytes;
+	}
+
+	//enqueue time of the next message, 0 when empty
+	int64_t frontTimestamp() const
+	{
+		return index.empty() ? 0 : index.front().timestamp;
+	}
+
+	//bytes currently held on disk
+	size_t diskBytes() const
+	{
+		return spilled_bytes;
+	}
+
+private:
+	struct Header
+	{
+		uint64_t len;
+		int64_t timestamp;
+		uint64_t seq;
+		uint64_t id;
+		int64_t deadline;
+		int32_t priority;
+		int32_t marked;
+	};
+
+	struct Segment
+	{
+		int fd;
+		char *base;
+		size_t capacity;
+		size_t write_off;
+		size_t read_off;
+	};
+
+	struct Entry
+	{
+		MsgLoader loader;
+		size_t bytes;
+		int64_t timestamp;
+	};
+
+	bool openSegment(size_t capacity)
+	{
+		static std::atomic<unsigned> counter(0);
+		char name[64];
+		snprintf(name, sizeof(name), "/msgqueue-spill-%d-%u.seg", (int)getpid(), counter++);
+		std::string path = dir + name;
+		int fd = open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+		if (fd < 0)
+			return false;
+		unlink(path.c_str());
+		if (ftruncate(fd, capacity) != 0)
+		{
+			close(fd);
+			return false;
+		}
+		void *base = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (base == MAP_FAILED)
+		{
+			close(fd);
+			return false;
+		}
+		Segment segment;
+		segment.fd = fd;
+		segment.base = (char *)base;
+		segment.capacity = capacity;
+		segment.write_off = 0;
+		segment.read_off = 0;
+		segments.push_back(segment);
+		return true;
+	}
+
+	void closeSegment()
+	{
+		Segment &head = segments.front();
+		munmap(head.base, head.capacity);
+		close(head.fd);
+		segments.pop_front();
+	}
+
+private:
+	std::string dir;
+	size_t segment_size;
+	size_t spilled_bytes;
+	std::string scratch;
+	std::deque<Segment> segments;
+	std::deque<Entry> index;
+};
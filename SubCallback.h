@@ -1,25 +1,86 @@
 #pragma once
 #include <memory>
 #include <functional>
+#include <cstdint>
 #include "Msg.h"
 
 class BaseSubCallback;
 using BaseSubCallbackPtr = std::shared_ptr<BaseSubCallback>;
 
+struct SubscribeOptions
+{
+	SubscribeOptions() : priority(0), max_rate(0), every_nth(1) {}
+
+	//Higher runs first within a topic's fan-out; equal priorities keep subscription order.
+	//Callbacks above 0 form a fast lane: in each dispatch round they run for every topic
+	//before any other callback does.
+	int priority;
+	//Downsampling, applied by the dispatcher before the callback is invoked: at most max_rate
+	//messages per second (0 = all), and only every every_nth message of the topic.
+	double max_rate;
+	uint32_t every_nth;
+};
 
 class BaseSubCallback : public std::enable_shared_from_this<BaseSubCallback>
 {
 public:
-	BaseSubCallback() {}
+	BaseSubCallback(const SubscribeOptions &options_ = SubscribeOptions()) :
+		options(options_),
+		interval_ns(options_.max_rate > 0 ? (int64_t)(1e9 / options_.max_rate) : 0),
+		next_due_ns(0),
+		skipped(0)
+	{
+	}
 	~BaseSubCallback() {}
 
 	virtual void call(const BaseMsgPtr msg)  = 0;
 
+	//msg is held by nothing but the dispatcher, so its payload may be moved out
+	virtual void take(const BaseMsgPtr msg) {
+		call(msg);
+	}
+
 	BaseSubCallbackPtr shared_from_base() {
 		return shared_from_this();
 	}
-private:
 
+	const SubscribeOptions &getoptions() const {
+		return options;
+	}
+
+	int getpriority() const {
+		return options.priority;
+	}
+
+	bool downsampled() const {
+		return interval_ns || options.every_nth > 1;
+	}
+
+	//whether the next message goes to this callback; now_ns is only read with a max_rate.
+	//Called by the one thread dispatching the topic.
+	bool sample(int64_t now_ns) {
+		if (options.every_nth > 1) {
+			//the first message, then every every_nth after it
+			bool take = skipped == 0;
+			skipped = (skipped + 1) % options.every_nth;
+			if (!take)
+				return false;
+		}
+		if (interval_ns) {
+			if (now_ns < next_due_ns)
+				return false;
+			//keep the average rate, but do not bank credit while the topic is quiet
+			next_due_ns += interval_ns;
+			if (next_due_ns <= now_ns)
+				next_due_ns = now_ns + interval_ns;
+		}
+		return true;
+	}
+private:
+	SubscribeOptions options;
+	int64_t interval_ns;
+	int64_t next_due_ns;
+	uint32_t skipped;
 };
 
 
@@ -31,7 +92,8 @@ class SubCallback : public BaseSubCallback
 public:
 	typedef std::function<void(const MsgPtr<T>)> Callback;
 
-	SubCallback(const Callback &callback_) :
+	SubCallback(const Callback &callback_, const SubscribeOptions &options_ = SubscribeOptions()) :
+		BaseSubCallback(options_),
 		callback(callback_)
 	{
 	}
@@ -52,3 +114,52 @@ private:
 
 template<typename T>
 using SubCallbackPtr = std::shared_ptr<SubCallback<T>>;
+
+//Receives the payload itself. As the only holder of a message the payload is moved out of it;
+//otherwise the callback gets a copy, and a move-only T is then not delivered at all.
+template<typename T>
+class OwnedSubCallback : public BaseSubCallback
+{
+public:
+	typedef std::function<void(T &&)> Callback;
+
+	OwnedSubCallback(const Callback &callback_, const SubscribeOptions &options_ = SubscribeOptions()) :
+		BaseSubCallback(options_),
+		callback(callback_)
+	{
+	}
+	~OwnedSubCallback()
+	{
+	}
+	virtual void call(BaseMsgPtr msg)
+	{
+		auto mptr = std::dynamic_pointer_cast<Msg<T>>(msg);
+		if (mptr) {
+			copyTo<T>(*mptr);
+		}
+	}
+
+	virtual void take(BaseMsgPtr msg)
+	{
+		auto mptr = std::dynamic_pointer_cast<Msg<T>>(msg);
+		if (mptr) {
+			callback(mptr->takeContent());
+		}
+	}
+
+private:
+	template<typename U>
+	typename std::enable_if<std::is_copy_constructible<U>::value>::type copyTo(const Msg<U> &msg)
+	{
+		U copy(msg.getContentRef());
+		callback(std::move(copy));
+	}
+
+	template<typename U>
+	typename std::enable_if<!std::is_copy_constructible<U>::value>::type copyTo(const Msg<U> &)
+	{
+	}
+
+private:
+	Callback callback;
+};
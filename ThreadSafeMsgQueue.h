@@ -6,46 +6,479 @@
 #include <iostream>
 #include <map>
 #include <list>
+#include <vector>
+#include <condition_variable>
 #include <thread>
 #include <chrono>
+#include <algorithm>
+#include <atomic>
+#include <exception>
 #include "MsgQueue.h"
+#include "RelaxedMsgQueue.h"
+#include "EdfMsgQueue.h"
+#include "TopicConfig.h"
 #include "SubCallback.h"
+#include "MsgHistory.h"
+#include "RtPublisher.h"
+#include "RateLimiter.h"
 
-class ThreadSafeMsgQueue;
+template <typename Policy>
+class BasicThreadSafeMsgQueue;
+using ThreadSafeMsgQueue = BasicThreadSafeMsgQueue<ThreadedPolicy>;
 using ThreadSafeMsgQueuePtr = std::shared_ptr< ThreadSafeMsgQueue>;
+//publish and runOnce() on one event loop thread; DispatcherPool, bridges and RT publishers need ThreadSafeMsgQueue
+using SingleThreadedBroker = BasicThreadSafeMsgQueue<SingleThreadedPolicy>;
 
-class ThreadSafeMsgQueue
+//snapshot of one topic, see ThreadSafeMsgQueue::stats()
+struct TopicStats
+{
+	TopicStats() : queued(0), used_bytes(0), sojourn_us(0), batch_size(1), latency_target_us(0), dispatched(0), dropped(0), marked(0), rate_limited(0), delayed(0), deadline_missed(0), cancelled(0) {}
+	size_t queued;
+	size_t used_bytes;
+	//queueing delay of the last dispatched message
+	int64_t sojourn_us;
+	//messages the topic currently dispatches per round
+	size_t batch_size;
+	int64_t latency_target_us;
+	uint64_t dispatched;
+	//by overflow policies and AQM
+	uint64_t dropped;
+	uint64_t marked;
+	//publishes over the topic's rate limit, and those waiting for their slot
+	uint64_t rate_limited;
+	size_t delayed;
+	//dispatched or dropped after their deadline, see EdfMsgQueue
+	uint64_t deadline_missed;
+	//tombstones skipped on dequeue, see MsgHandle
+	uint64_t cancelled;
+};
+
+//Synchronization, clock and queue containers come from Policy (see QueuePolicy.h), which also
+//picks the topics' queue type.
+template <typename Policy>
+class BasicThreadSafeMsgQueue
 {
 public:
-	static ThreadSafeMsgQueuePtr getInstance()
+	typedef BasicMsgQueue<Policy> Queue;
+	typedef std::shared_ptr<Queue> QueuePtr;
+	typedef typename Policy::Mutex Mutex;
+	typedef typename Policy::Condition Condition;
+
+	static std::shared_ptr<BasicThreadSafeMsgQueue> getInstance()
 	{
-		static ThreadSafeMsgQueuePtr instance_ptr = nullptr;
+		static std::shared_ptr<BasicThreadSafeMsgQueue> instance_ptr = nullptr;
 		if (instance_ptr == nullptr) {
-			instance_ptr.reset(new ThreadSafeMsgQueue());
+			instance_ptr.reset(new BasicThreadSafeMsgQueue());
 		}
 		return instance_ptr;
 	}
-	~ThreadSafeMsgQueue()
+
+	//a broker of its own, independent of getInstance()'s, e.g. one per subsystem
+	static std::shared_ptr<BasicThreadSafeMsgQueue> create()
+	{
+		return std::shared_ptr<BasicThreadSafeMsgQueue>(new BasicThreadSafeMsgQueue());
+	}
+	~BasicThreadSafeMsgQueue()
 	{
 
 	}
 
+	//false when the topic's overflow policy or a Drop rate limit dropped the message, or the
+	//topic was not declared while the broker is strict. Inside a subscribe callback the message
+	//is buffered and enqueued once the callback returns, and true only means it was buffered;
+	//there a full Block budget drops it rather than stall the dispatcher.
 	template<typename MSG_TYPE>
-	void publish(std::string topic, MsgPtr<MSG_TYPE> msg_ptr)
+	bool publish(std::string topic, MsgPtr<MSG_TYPE> msg_ptr)
 	{
-		std::lock_guard<std::mutex> lg(mtx);
-		if (msg_queues.find(topic) == msg_queues.end()) {
-			msg_queues[topic].reset(new MsgQueue());
+		DispatchContext &ctx = context();
+		if (ctx.depth) {
+			ctx.pending.push_back(std::make_pair(std::move(topic), msg_ptr->shared_from_base()));
+			return true;
+		}
+		Route route;
+		{
+			std::lock_guard<Mutex> lg(mtx);
+			route = findRoute(topic);
 		}
-		msg_queues[topic]->enqueue(msg_ptr->shared_from_base());
+		if (!route.queue)
+			return false;
+		//enqueue may block on a memory budget, which dispatch frees under mtx
+		InFlight hold(route);
+		return deliver(ctx, route, msg_ptr->shared_from_base());
 	}
 
+	//as above, and handle can cancel or replace the message until a dispatcher dequeues it
 	template<typename MSG_TYPE>
-	void subscribe(std::string topic, std::function<void(const MsgPtr<MSG_TYPE> msg)> callback)
+	bool publish(std::string topic, MsgPtr<MSG_TYPE> msg_ptr, MsgHandle<MSG_TYPE> &handle)
+	{
+		msg_ptr->track();
+		handle = MsgHandle<MSG_TYPE>(msg_ptr);
+		if (publish(std::move(topic), msg_ptr))
+			return true;
+		//never queued: nothing left to cancel
+		msg_ptr->claim();
+		return false;
+	}
+
+	//wait-free publisher for a real-time thread; values are moved into topic by the dispatcher.
+	//huge_pages puts the ring and its message pool on 2 MiB pages
+	template<typename MSG_TYPE>
+	RtPublisherPtr<MSG_TYPE> advertiseRt(std::string topic, size_t capacity, int priority = 0, bool huge_pages = false)
+	{
+		RtPublisherPtr<MSG_TYPE> publisher(new RtPublisher<MSG_TYPE>(capacity, priority, huge_pages));
+		std::lock_guard<Mutex> lg(mtx);
+		if (!declared(topic))
+			return nullptr;
+		if (prefault_storage)
+			publisher->prefault();
+		rt_channels.push_back(std::make_pair(topic, BaseRtChannelPtr(publisher)));
+		return publisher;
+	}
+
+	//Declare topics up front. Their queues, budgets, dedup filters, history and storage are built
+	//here rather than on first publish, and installed together; nothing changes and false is
+	//returned when a declared topic already holds messages or is being published to. A topic
+	//declared again keeps its retained history if its depth is unchanged. config.strict makes
+	//publish(), subscribe(), advertiseRt() and the per-topic setters fail for any other topic.
+	bool configure(const BrokerConfig &config, std::string *error = nullptr)
+	{
+		std::vector<QueuePtr> queues;
+		std::vector<MsgHistoryPtr> histories;
+		std::vector<RateLimiterPtr> limiters;
+		std::vector<MemoryResourcePtr> resources;
+		MemoryResourcePtr broker_resource;
+		{
+			std::lock_guard<Mutex> lg(mtx);
+			broker_resource = default_resource;
+		}
+		if (config.allocator != AllocatorKind::Default)
+			broker_resource = makeResource(config.allocator, config.arena_bytes);
+		for (size_t i = 0; i < config.topics.size(); ++i)
+		{
+			const TopicConfig &tc = config.topics[i];
+			QueuePtr queue;
+			if (tc.queue == QueueKind::Relaxed)
+				queue.reset(newRelaxedQueue(tc.relaxed_threads, (Queue *)nullptr));
+			else if (tc.queue == QueueKind::Deadline)
+				queue.reset(new BasicEdfMsgQueue<Policy>(tc.drop_missed));
+			else
+				queue.reset(new Queue());
+			queue->setGlobalBudget(global_budget);
+			if (tc.budget)
+				queue->setBudget(tc.budget, tc.overflow);
+			if (tc.rate_limit > 0)
+				limiters.push_back(RateLimiterPtr(new RateLimiter(tc.rate_limit, tc.rate_burst, tc.rate_policy)));
+			else
+				limiters.push_back(nullptr);
+			if (tc.aqm_target_us)
+				queue->setAqm(tc.aqm_target_us, tc.aqm_interval_us, tc.aqm_mark);
+			if (tc.dedup_window_us)
+				queue->setDedup(DedupFilterPtr(new DedupFilter(tc.dedup_window_us, tc.dedup_expected_ids)));
+			resources.push_back(tc.allocator != AllocatorKind::Default ? makeResource(tc.allocator, tc.arena_bytes) : broker_resource);
+			if (resources.back())
+				queue->setMemoryResource(resources.back());
+			if (tc.capacity)
+				queue->reserve(tc.capacity, tc.huge_pages);
+			queues.push_back(queue);
+			histories.push_back(MsgHistoryPtr(tc.history_depth ? new MsgHistory(tc.history_depth) : nullptr));
+		}
+		std::lock_guard<Mutex> lg(mtx);
+		for (size_t i = 0; i < config.topics.size(); ++i)
+		{
+			auto itr = topics.find(config.topics[i].name);
+			if (itr != topics.end() && (itr->second->queue->size() || itr->second->in_flight)) {
+				if (error)
+					*error = "topic '" + config.topics[i].name + "' already holds messages";
+				return false;
+			}
+		}
+		for (size_t i = 0; i < config.topics.size(); ++i)
+		{
+			const TopicConfig &tc = config.topics[i];
+			TopicPtr t = getTopic(tc.name);
+			t->queue = queues[i];
+			if (!(t->history && t->history->depth() == tc.history_depth))
+				t->history = histories[i];
+			t->limiter = limiters[i];
+			t->resource = resources[i];
+			t->latency_target = tc.latency_target_us;
+			t->max_batch = tc.latency_target_us > 0 ? (std::max)(tc.max_batch, (size_t)1) : 1;
+			t->batch = 1;
+		}
+		global_budget->setLimit(config.memory_budget);
+		default_resource = broker_resource;
+		strict = config.strict;
+		prefault_storage = config.prefault;
+		return true;
+	}
+
+	//replace the queue behind a topic, e.g. with a RelaxedMsgQueue; fails once the old queue holds
+	//messages, or while a publish is about to enqueue into it
+	bool setQueue(std::string topic, QueuePtr queue)
+	{
+		std::lock_guard<Mutex> lg(mtx);
+		TopicPtr t = declared(topic);
+		if (!t || t->queue->size() || t->in_flight)
+			return false;
+		queue->setGlobalBudget(global_budget);
+		if (t->resource)
+			queue->setMemoryResource(t->resource);
+		t->queue = queue;
+		return true;
+	}
+
+	//memory resource of topics created from now on; nullptr = operator new
+	void setMemoryResource(MemoryResourcePtr resource)
+	{
+		std::lock_guard<Mutex> lg(mtx);
+		default_resource = resource;
+	}
+
+	//memory resource of one topic, e.g. a MonotonicResource for a request-scoped topic or a
+	//PoolResource for a long-lived one; fails while the topic's queue holds messages
+	bool setMemoryResource(std::string topic, MemoryResourcePtr resource)
+	{
+		std::lock_guard<Mutex> lg(mtx);
+		TopicPtr t = declared(topic);
+		if (!t || !t->queue->setMemoryResource(resource))
+			return false;
+		t->resource = resource;
+		return true;
+	}
+
+	//Swap topic's MonotonicResource for a fresh one, so a request-scoped topic (topics live as
+	//long as the broker) does not grow its arena without bound. Only while the topic holds no
+	//queued, delayed or retained messages; the old arena is freed once the last message made
+	//from it is gone. False without a MonotonicResource.
+	bool resetArena(std::string topic)
+	{
+		std::lock_guard<Mutex> lg(mtx);
+		auto itr = topics.find(topic);
+		if (itr == topics.end() || !idle(*itr->second))
+			return false;
+		Topic &t = *itr->second;
+		MonotonicResource *arena = dynamic_cast<MonotonicResource *>(t.resource.get());
+		if (!arena)
+			return false;
+		MemoryResourcePtr fresh(new MonotonicResource(arena->blockBytes(), arena->upstreamResource()));
+		if (!t.queue->setMemoryResource(fresh))
+			return false;
+		t.resource = fresh;
+		return true;
+	}
+
+	//the same for the arena of BrokerConfig::allocator = monotonic, shared by every topic
+	//without its own; all of them must be idle
+	bool resetArena()
+	{
+		std::lock_guard<Mutex> lg(mtx);
+		MonotonicResource *arena = dynamic_cast<MonotonicResource *>(default_resource.get());
+		if (!arena)
+			return false;
+		for (auto itr = topics.begin(); itr != topics.end(); ++itr)
+		{
+			if (itr->second->resource == default_resource && !idle(*itr->second))
+				return false;
+		}
+		MemoryResourcePtr fresh(new MonotonicResource(arena->blockBytes(), arena->upstreamResource()));
+		for (auto itr = topics.begin(); itr != topics.end(); ++itr)
+		{
+			Topic &t = *itr->second;
+			if (t.resource != default_resource)
+				continue;
+			t.queue->setMemoryResource(fresh);
+			t.resource = fresh;
+		}
+		default_resource = fresh;
+		return true;
+	}
+
+	//a message allocated from topic's memory resource, to publish on it
+	template<typename MSG_TYPE, typename CONTENT>
+	MsgPtr<MSG_TYPE> make(const std::string &topic, CONTENT &&content, int priority = 0)
+	{
+		MemoryResourcePtr resource;
+		{
+			std::lock_guard<Mutex> lg(mtx);
+			auto itr = topics.find(topic);
+			resource = itr != topics.end() ? itr->second->resource : default_resource;
+		}
+		return makeMsg<MSG_TYPE>(resource, std::forward<CONTENT>(content), priority);
+	}
+
+	//create topic up front with queue storage for messages, so publishing to it does not allocate;
+	//huge_pages backs that storage with 2 MiB pages for large queues
+	bool reserve(std::string topic, size_t messages, bool huge_pages = false)
 	{
-		std::lock_guard<std::mutex> lg(mtx);
-		SubCallbackPtr<MSG_TYPE> callback_ptr(new SubCallback<MSG_TYPE>(callback));
-		msg_callbacks[topic].push_back(callback_ptr);
+		std::lock_guard<Mutex> lg(mtx);
+		TopicPtr t = declared(topic);
+		if (!t)
+			return false;
+		t->queue->reserve(messages, huge_pages);
+		return true;
+	}
+
+	//bound the bytes queued under a topic, 0 = unlimited
+	bool setTopicBudget(std::string topic, size_t bytes, OverflowPolicy policy = OverflowPolicy::Block)
+	{
+		std::lock_guard<Mutex> lg(mtx);
+		TopicPtr t = declared(topic);
+		if (!t)
+			return false;
+		t->queue->setBudget(bytes, policy);
+		return true;
+	}
+
+	//bound the bytes queued across all topics, 0 = unlimited; the topic's policy applies when exhausted
+	void setMemoryBudget(size_t bytes)
+	{
+		global_budget->setLimit(bytes);
+	}
+
+	size_t usedBytes() const
+	{
+		return global_budget->used();
+	}
+
+	//drop messages whose id (BaseMsg::setid) repeats within window_us on this topic
+	bool setDedup(std::string topic, int64_t window_us, size_t expected_ids = 1 << 16)
+	{
+		std::lock_guard<Mutex> lg(mtx);
+		TopicPtr t = declared(topic);
+		if (!t)
+			return false;
+		t->queue->setDedup(DedupFilterPtr(new DedupFilter(window_us, expected_ids)));
+		return true;
+	}
+
+	size_t usedBytes(std::string topic)
+	{
+		std::lock_guard<Mutex> lg(mtx);
+		auto itr = topics.find(topic);
+		return itr == topics.end() ? 0 : itr->second->queue->usedBytes();
+	}
+
+	//Limit publishes to topic to rate messages per second, allowing bursts of burst messages;
+	//policy picks what happens past the limit. Delayed messages are queued by the dispatcher
+	//once due. rate 0 removes the limit.
+	bool setRateLimit(std::string topic, double rate, double burst = 1, RateLimitPolicy policy = RateLimitPolicy::Drop)
+	{
+		std::lock_guard<Mutex> lg(mtx);
+		TopicPtr t = declared(topic);
+		if (!t)
+			return false;
+		if (!t->limiter)
+			t->limiter.reset(new RateLimiter());
+		t->limiter->configure(rate, burst, policy);
+		return true;
+	}
+
+	//same for everything published by threads that called setPublisherIdentity(publisher),
+	//across all topics; checked before the topic's own limit
+	void setPublisherRateLimit(std::string publisher, double rate, double burst = 1, RateLimitPolicy policy = RateLimitPolicy::Drop)
+	{
+		std::lock_guard<Mutex> lg(mtx);
+		publisherLimiter(publisher)->configure(rate, burst, policy);
+	}
+
+	//name the calling thread's publishes for setPublisherRateLimit; "" clears it
+	void setPublisherIdentity(std::string publisher)
+	{
+		RateLimiterPtr limiter;
+		if (!publisher.empty()) {
+			std::lock_guard<Mutex> lg(mtx);
+			limiter = publisherLimiter(publisher);
+		}
+		context().publisher_limiter = limiter;
+	}
+
+	//most messages a topic holds back for Delay rate limits (default 4096); past it, or past the
+	//topic's budgets, which delayed messages are charged to, they are dropped as with Drop
+	void setDelayLimit(size_t messages)
+	{
+		std::lock_guard<Mutex> lg(mtx);
+		delay_limit = messages;
+	}
+
+	//CoDel on the topic's queue, see MsgQueue::setAqm; target_us 0 disables
+	bool setAqm(std::string topic, int64_t target_us, int64_t interval_us = 100000, bool mark = false)
+	{
+		std::lock_guard<Mutex> lg(mtx);
+		TopicPtr t = declared(topic);
+		if (!t)
+			return false;
+		t->queue->setAqm(target_us, interval_us, mark);
+		return true;
+	}
+
+	//Dispatch up to max_batch messages of topic per round instead of one. The batch doubles while
+	//messages back up and halves once the topic is idle, and never grows past what its callbacks
+	//get through within target_us, so batching does not hold a message back longer than the
+	//target. target_us 0 restores one message per round.
+	bool setLatencyTarget(std::string topic, int64_t target_us, size_t max_batch = 256)
+	{
+		std::lock_guard<Mutex> lg(mtx);
+		TopicPtr t = declared(topic);
+		if (!t)
+			return false;
+		t->latency_target = target_us;
+		t->max_batch = target_us > 0 ? (std::max)(max_batch, (size_t)1) : 1;
+		t->batch = (std::min)(t->batch, t->max_batch);
+		return true;
+	}
+
+	TopicStats stats(std::string topic)
+	{
+		TopicStats result;
+		std::lock_guard<Mutex> lg(mtx);
+		auto itr = topics.find(topic);
+		if (itr == topics.end())
+			return result;
+		const Topic &t = *itr->second;
+		result.queued = t.queue->size();
+		result.used_bytes = t.queue->usedBytes();
+		result.sojourn_us = t.queue->sojourn();
+		result.batch_size = t.batch;
+		result.latency_target_us = t.latency_target;
+		result.dispatched = t.dispatched;
+		result.dropped = t.queue->dropped();
+		result.marked = t.queue->marked();
+		result.rate_limited = t.limiter ? t.limiter->limited() : 0;
+		result.delayed = t.delayed.size();
+		result.deadline_missed = t.queue->missed();
+		result.cancelled = t.queue->cancelled();
+		return result;
+	}
+
+	//new subscribers first receive the last depth messages dispatched on topic; 0 disables
+	bool setHistoryDepth(std::string topic, size_t depth)
+	{
+		std::lock_guard<Mutex> lg(mtx);
+		TopicPtr t = declared(topic);
+		if (!t)
+			return false;
+		t->history.reset(depth ? new MsgHistory(depth) : nullptr);
+		return true;
+	}
+
+	//Safe to call from inside a callback; options.priority orders the topic's fan-out. From inside
+	//a callback, a subscription to a topic with history that another thread is dispatching takes
+	//effect once this thread's dispatch round is over. Like the per-topic setters, false for a
+	//topic that was not declared while the broker is strict.
+	template<typename MSG_TYPE>
+	bool subscribe(std::string topic, std::function<void(const MsgPtr<MSG_TYPE> msg)> callback, const SubscribeOptions &options = SubscribeOptions())
+	{
+		return addCallback(topic, SubCallbackPtr<MSG_TYPE>(new SubCallback<MSG_TYPE>(callback, options)));
+	}
+
+	//Like subscribe(), but callback receives the payload. Where it is the topic's only
+	//subscriber, the topic keeps no history and nothing else (the publisher, another topic)
+	//still holds the message, each payload is moved into it without a copy; this is how
+	//move-only payloads (e.g. std::unique_ptr buffers) are handed off.
+	template<typename MSG_TYPE>
+	bool subscribeOwned(std::string topic, std::function<void(MSG_TYPE &&)> callback, const SubscribeOptions &options = SubscribeOptions())
+	{
+		return addCallback(topic, BaseSubCallbackPtr(new OwnedSubCallback<MSG_TYPE>(callback, options)));
 	}
 
 	void run()
@@ -61,36 +494,686 @@ public:
 		}
 	}
 
+	//Dispatches one message per topic, or a batch where a latency target is set. Messages are
+	//claimed under mtx and callbacks run without it, so they may publish and subscribe; a topic
+	//being dispatched by one thread is skipped by the others, which keeps each topic's delivery
+	//order; see setDispatchers() for how many topics one call claims. Fast-lane callbacks
+	//(priority > 0) of all claimed topics run before the rest. A callback
+	//that throws does not stop the round: the other claimed messages are still delivered, then
+	//the first exception is rethrown.
 	bool runOnce()
 	{
-		bool busy = false;
-		std::lock_guard<std::mutex> lg(mtx);
-		for (auto itr = msg_queues.begin(); itr != msg_queues.end(); ++itr)
-		{
-			BaseMsgPtr msg_ptr = itr->second->dequeue();
-			if (msg_ptr) {
-				busy = true;
-				if (msg_callbacks.find(itr->first) != msg_callbacks.end()) {
-					for (auto pos = msg_callbacks[itr->first].begin(); pos != msg_callbacks[itr->first].end(); ++pos)
-					{						
-						(*pos)->call(msg_ptr);
+		DispatchContext &ctx = context();
+		std::vector<Dispatch> work;
+		std::vector<BaseMsgPtr> msgs;
+		work.swap(ctx.spare);
+		msgs.swap(ctx.spare_msgs);
+		drainRt(ctx);
+		releaseDelayed(ctx);
+		{
+			std::lock_guard<Mutex> lg(mtx);
+			work.reserve(topics.size());
+			size_t limit = claimLimit();
+			auto itr = limit < topics.size() ? topics.lower_bound(next_topic) : topics.begin();
+			for (size_t n = 0; n < topics.size() && work.size() < limit; ++n, ++itr)
+			{
+				if (itr == topics.end())
+					itr = topics.begin();
+				TopicPtr &t = itr->second;
+				if (t->dispatching)
+					continue;
+				size_t first = msgs.size();
+				if (!t->queue->dequeue_batch(msgs, t->batch))
+					continue;
+				claim(t);
+				if (t->history) {
+					for (size_t i = first; i < msgs.size(); ++i)
+						t->history->push(msgs[i]);
+				}
+				Dispatch d;
+				d.topic = t;
+				d.first = first;
+				d.count = msgs.size() - first;
+				d.callbacks = t->callbacks;
+				//callbacks are sorted by priority, so the fast lane is a prefix
+				d.fast = 0;
+				while (d.callbacks && d.fast < d.callbacks->size() && (*d.callbacks)[d.fast]->getpriority() > 0)
+					++d.fast;
+				d.timed = t->latency_target > 0;
+				d.cost_ns = 0;
+				d.exclusive = !t->history && d.callbacks && d.callbacks->size() == 1;
+				work.push_back(std::move(d));
+			}
+			if (limit < topics.size())
+				next_topic = itr == topics.end() ? std::string() : itr->first;
+		}
+		bool busy = !work.empty();
+		std::exception_ptr error;
+		for (int lane = 0; lane < 2; ++lane)
+		{
+			for (size_t i = 0; i < work.size(); ++i)
+			{
+				Dispatch &d = work[i];
+				if (!d.callbacks)
+					continue;
+				const std::vector<BaseSubCallbackPtr> &callbacks = *d.callbacks;
+				size_t begin = lane ? d.fast : 0;
+				size_t end = lane ? callbacks.size() : d.fast;
+				if (begin == end)
+					continue;
+				auto start = d.timed ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+				for (size_t m = d.first; m < d.first + d.count; ++m)
+				{
+					for (size_t c = begin; c < end; ++c)
+					{
+						if (callbacks[c]->downsampled() && !callbacks[c]->sample(RateLimiter::now()))
+							continue;
+						try {
+							//the round's reference is the only one left, so no one else can see the payload go
+							invoke(callbacks[c], msgs[m], d.exclusive && msgs[m].use_count() == 1);
+						}
+						catch (...) {
+							if (!error)
+								error = std::current_exception();
+						}
 					}
 				}
+				if (d.timed)
+					d.cost_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
 			}
 		}
+		finish(work, msgs);
+		work.swap(ctx.spare);
+		msgs.swap(ctx.spare_msgs);
+		addDeferred(ctx);
+		if (error)
+			std::rethrow_exception(error);
 		return busy;
 	}
 
+	//Threads calling runOnce() concurrently, e.g. a DispatcherPool's workers (default 1). With
+	//more than one, each call claims at most its share of the topics, starting where the last
+	//call stopped, so the callers dispatch different topics in parallel instead of the first
+	//one taking them all.
+	void setDispatchers(size_t threads)
+	{
+		dispatchers = (std::max)(threads, (size_t)1);
+	}
+
+	//touch reserved queue storage, real-time rings and their message pools, so the first
+	//messages do not page fault; see BrokerConfig::prefault
+	void prefault()
+	{
+		std::lock_guard<Mutex> lg(mtx);
+		for (auto itr = topics.begin(); itr != topics.end(); ++itr)
+			itr->second->queue->prefault();
+		for (size_t i = 0; i < rt_channels.size(); ++i)
+			rt_channels[i].second->prefault();
+	}
+
+	//messages waiting in all topics
+	size_t size()
+	{
+		size_t total = 0;
+		std::lock_guard<Mutex> lg(mtx);
+		for (auto itr = topics.begin(); itr != topics.end(); ++itr)
+		{
+			total += itr->second->queue->size();
+		}
+		return total;
+	}
+
+	//worst queueing delay (microseconds) of the message at the head of any topic, so a topic
+	//nobody dispatches from keeps raising it
+	int64_t lag()
+	{
+		int64_t worst = 0;
+		std::lock_guard<Mutex> lg(mtx);
+		for (auto itr = topics.begin(); itr != topics.end(); ++itr)
+		{
+			worst = (std::max)(worst, itr->second->queue->headAge());
+		}
+		return worst;
+	}
+
 private:
-	ThreadSafeMsgQueue()
+	struct DelayedMsg
 	{
-		MsgQueuePtr default_queue(new MsgQueue());
-		msg_queues[""] = default_queue;
+		int64_t due;
+		uint64_t order;
+		BaseMsgPtr msg;
+		//the queue whose budgets msg is charged to until it is released
+		QueuePtr queue;
+		//for a min-heap on (due, order)
+		bool operator<(const DelayedMsg &other) const
+		{
+			return due != other.due ? due > other.due : order > other.order;
+		}
+	};
+
+	struct Topic
+	{
+		Topic() : in_flight(0), dispatching(false), batch(1), max_batch(1), latency_target(0), cost_ns(0), dispatched(0) {}
+		QueuePtr queue;
+		//routes to queue being used outside mtx; taken under mtx, so the queue is not swapped
+		//from under them while nonzero
+		typename Policy::template Atomic<int> in_flight;
+		//copy-on-write, so dispatch can walk a snapshot without holding mtx
+		std::shared_ptr<const std::vector<BaseSubCallbackPtr> > callbacks;
+		MsgHistoryPtr history;
+		//for the queue's containers and make(); nullptr = operator new
+		MemoryResourcePtr resource;
+		bool dispatching;
+		std::thread::id dispatcher;
+		RateLimiterPtr limiter;
+		//min-heap of messages held back by a Delay rate limit
+		std::vector<DelayedMsg> delayed;
+		//adaptive batching, see setLatencyTarget()
+		size_t batch;
+		size_t max_batch;
+		int64_t latency_target;
+		//moving average of callback time per message
+		double cost_ns;
+		uint64_t dispatched;
+	};
+	typedef std::shared_ptr<Topic> TopicPtr;
+
+	//what a publish needs of its topic, copied under mtx
+	struct Route
+	{
+		TopicPtr topic;
+		QueuePtr queue;
+		RateLimiterPtr limiter;
+	};
+
+	//releases a route taken by route() once it has been used
+	struct InFlight
+	{
+		explicit InFlight(const Route &_route) : route(_route) {}
+		~InFlight()
+		{
+			if (route.topic)
+				route.topic->in_flight.fetch_sub(1);
+		}
+		const Route &route;
+	};
+
+	//a topic's batch: msgs[first, first + count) of the round
+	struct Dispatch
+	{
+		TopicPtr topic;
+		size_t first;
+		size_t count;
+		std::shared_ptr<const std::vector<BaseSubCallbackPtr> > callbacks;
+		//callbacks[0, fast) are the fast lane
+		size_t fast;
+		bool timed;
+		int64_t cost_ns;
+		//a single callback and no history: the callback may take the payload of unshared messages
+		bool exclusive;
+	};
+
+	//per-thread state of the callbacks running on it
+	struct DispatchContext
+	{
+		DispatchContext() : depth(0) {}
+		int depth;
+		//published from inside callbacks, enqueued after the outermost callback returns
+		std::vector<std::pair<std::string, BaseMsgPtr> > pending;
+		std::vector<Route> pending_routes;
+		std::vector<std::pair<Route, DelayedMsg> > released;
+		//see setPublisherIdentity()
+		RateLimiterPtr publisher_limiter;
+		std::vector<std::pair<BaseRtChannelPtr, Route> > rt_drain;
+		//subscriptions that would have waited for another dispatcher, see addCallback()
+		std::vector<std::pair<std::string, BaseSubCallbackPtr> > deferred;
+		//reused by runOnce to avoid allocating per call
+		std::vector<Dispatch> spare;
+		std::vector<BaseMsgPtr> spare_msgs;
+	};
+
+	//the calling thread's contexts, one per broker by instance_id; a destroyed broker's (empty)
+	//context stays until the thread exits
+	static std::map<uint64_t, DispatchContext> &contexts()
+	{
+		static thread_local std::map<uint64_t, DispatchContext> per_broker;
+		return per_broker;
+	}
+
+	DispatchContext &context()
+	{
+		//brokers are usually used one at a time per thread, so remember the last one
+		static thread_local uint64_t last_id = 0;
+		static thread_local DispatchContext *last = nullptr;
+		if (last_id != instance_id) {
+			last = &contexts()[instance_id];
+			last_id = instance_id;
+		}
+		return *last;
+	}
+
+	//never reused, unlike addresses, so a context cannot outlive its broker into a new one
+	static uint64_t nextInstanceId()
+	{
+		static std::atomic<uint64_t> next(1);
+		return next++;
+	}
+
+	BasicThreadSafeMsgQueue() : instance_id(nextInstanceId()), global_budget(new MemoryBudget()), default_resource(nullptr), strict(false), delayed_count(0), delay_seq(0), delay_limit(4096), dispatchers(1), prefault_storage(false)
+	{
+		getQueue("");
+	}
+
+	//caller holds mtx
+	TopicPtr getTopic(const std::string &topic)
+	{
+		TopicPtr &t = topics[topic];
+		if (!t) {
+			t.reset(new Topic());
+			t->queue.reset(new Queue());
+			t->queue->setGlobalBudget(global_budget);
+			t->resource = default_resource;
+			if (default_resource)
+				t->queue->setMemoryResource(default_resource);
+		}
+		return t;
+	}
+
+	//nothing queued, delayed, retained or about to be enqueued; caller holds mtx
+	static bool idle(Topic &t)
+	{
+		return !t.queue->size() && !t.in_flight && t.delayed.empty() && (!t.history || !t.history->size());
+	}
+
+	//caller holds mtx
+	QueuePtr getQueue(const std::string &topic)
+	{
+		return getTopic(topic)->queue;
+	}
+
+	//getTopic(), but nullptr for a topic that was not declared while the broker is strict; caller holds mtx
+	TopicPtr declared(const std::string &topic)
+	{
+		if (!strict)
+			return getTopic(topic);
+		auto itr = topics.find(topic);
+		return itr == topics.end() ? nullptr : itr->second;
+	}
+
+	//no queue for a topic that was not declared while the broker is strict; caller holds mtx
+	Route findRoute(const std::string &topic)
+	{
+		TopicPtr t = declared(topic);
+		return t ? route(t) : Route();
+	}
+
+	//t's queue, held until an InFlight over the route goes away; caller holds mtx
+	static Route route(const TopicPtr &t)
+	{
+		Route result;
+		result.topic = t;
+		result.queue = t->queue;
+		result.limiter = t->limiter;
+		t->in_flight.fetch_add(1);
+		return result;
+	}
+
+	//caller holds mtx
+	RateLimiterPtr publisherLimiter(const std::string &publisher)
+	{
+		RateLimiterPtr &limiter = publisher_limits[publisher];
+		if (!limiter)
+			limiter.reset(new RateLimiter());
+		return limiter;
+	}
+
+	//apply the publisher's and the topic's rate limits, and enqueue msg or hold it until due.
+	//A token is taken from both limiters or neither: Drop limits are checked first, and tokens
+	//already taken are refunded when msg is dropped.
+	bool deliver(DispatchContext &ctx, const Route &route, const BaseMsgPtr &msg, Admission admission = Admission::Wait)
+	{
+		RateLimiter *limiters[2] = {ctx.publisher_limiter.get(), route.limiter.get()};
+		RateLimiter *taken[2];
+		int taken_count = 0;
+		int64_t due = 0;
+		for (int pass = 0; pass < 2; ++pass)
+		{
+			for (int i = 0; i < 2; ++i)
+			{
+				RateLimiter *limiter = limiters[i];
+				if (!limiter || limiter->unlimited() || (limiter->policy() == RateLimitPolicy::Drop) != (pass == 0))
+					continue;
+				switch (limiter->policy())
+				{
+				case RateLimitPolicy::Drop:
+					if (!limiter->tryAcquire(RateLimiter::now())) {
+						refund(taken, taken_count);
+						return false;
+					}
+					break;
+				case RateLimitPolicy::Block:
+					limiter->acquire();
+					break;
+				case RateLimitPolicy::Delay:
+					due = (std::max)(due, limiter->reserve(RateLimiter::now()));
+					break;
+				}
+				taken[taken_count++] = limiter;
+			}
+		}
+		if (due > RateLimiter::now()) {
+			std::lock_guard<Mutex> lg(mtx);
+			Topic &t = *route.topic;
+			if (t.delayed.size() >= delay_limit || !route.queue->hold(msg)) {
+				refund(taken, taken_count);
+				return false;
+			}
+			DelayedMsg d;
+			d.due = due;
+			d.order = delay_seq++;
+			d.msg = msg;
+			d.queue = route.queue;
+			t.delayed.push_back(d);
+			std::push_heap(t.delayed.begin(), t.delayed.end());
+			++delayed_count;
+			return true;
+		}
+		return route.queue->enqueue(msg, admission);
+	}
+
+	static void refund(RateLimiter **limiters, int count)
+	{
+		for (int i = 0; i < count; ++i)
+			limiters[i]->refund();
+	}
+
+	//queue delayed messages that are due
+	void releaseDelayed(DispatchContext &ctx)
+	{
+		{
+			std::lock_guard<Mutex> lg(mtx);
+			if (!delayed_count)
+				return;
+			int64_t now_ns = RateLimiter::now();
+			for (auto itr = topics.begin(); itr != topics.end(); ++itr)
+			{
+				std::vector<DelayedMsg> &delayed = itr->second->delayed;
+				while (!delayed.empty() && delayed.front().due <= now_ns)
+				{
+					std::pop_heap(delayed.begin(), delayed.end());
+					ctx.released.push_back(std::make_pair(route(itr->second), delayed.back()));
+					delayed.pop_back();
+					--delayed_count;
+				}
+			}
+		}
+		//the held charge moves into the queue, so no publisher can take those bytes meanwhile and
+		//leave this thread waiting on a budget only it drains
+		for (size_t i = 0; i < ctx.released.size(); ++i)
+		{
+			InFlight hold(ctx.released[i].first);
+			const QueuePtr &queue = ctx.released[i].first.queue;
+			DelayedMsg &d = ctx.released[i].second;
+			if (queue == d.queue) {
+				queue->enqueue(d.msg, Admission::Held);
+			}
+			else {
+				//setQueue() swapped the topic's queue while msg waited
+				d.queue->unhold(d.msg);
+				queue->enqueue(d.msg, Admission::NoWait);
+			}
+		}
+		ctx.released.clear();
+	}
+
+	//caller holds mtx
+	//topics one runOnce() may claim; caller holds mtx
+	size_t claimLimit()
+	{
+		size_t n = dispatchers;
+		return n > 1 ? (std::max)(topics.size() / n, (size_t)1) : topics.size();
+	}
+
+	void claim(const TopicPtr &t)
+	{
+		t->dispatching = true;
+		t->dispatcher = std::this_thread::get_id();
+	}
+
+	void unclaim(const TopicPtr &t)
+	{
+		{
+			std::lock_guard<Mutex> lg(mtx);
+			t->dispatching = false;
+		}
+		dispatch_cv.notify_all();
+	}
+
+	void finish(std::vector<Dispatch> &work, std::vector<BaseMsgPtr> &msgs)
+	{
+		if (work.empty())
+			return;
+		{
+			std::lock_guard<Mutex> lg(mtx);
+			for (size_t i = 0; i < work.size(); ++i)
+			{
+				Topic &t = *work[i].topic;
+				t.dispatching = false;
+				t.dispatched += work[i].count;
+				if (work[i].timed)
+					adaptBatch(t, work[i]);
+			}
+		}
+		dispatch_cv.notify_all();
+		work.clear();
+		msgs.clear();
+	}
+
+	static MsgQueue *newRelaxedQueue(size_t threads, MsgQueue *)
+	{
+		return threads ? new RelaxedMsgQueue(threads) : new RelaxedMsgQueue();
+	}
+
+	//RelaxedMsgQueue only trades order for less contention, so without threads it is an ordered queue
+	template<typename Q>
+	static Q *newRelaxedQueue(size_t, Q *)
+	{
+		return new Q();
+	}
+
+	static MemoryResourcePtr makeResource(AllocatorKind kind, size_t arena_bytes)
+	{
+		if (kind == AllocatorKind::Pool)
+			return MemoryResourcePtr(new PoolResource());
+		if (kind == AllocatorKind::Monotonic)
+			return MemoryResourcePtr(arena_bytes ? new MonotonicResource(arena_bytes) : new MonotonicResource());
+		return nullptr;
+	}
+
+	//grow the batch under backlog, shrink it when idle, cap it by the latency target; caller holds mtx
+	void adaptBatch(Topic &t, const Dispatch &d)
+	{
+		double per_msg = (double)d.cost_ns / d.count;
+		t.cost_ns = t.cost_ns > 0 ? 0.8 * t.cost_ns + 0.2 * per_msg : per_msg;
+		size_t backlog = t.queue->size();
+		if (backlog >= t.batch)
+			t.batch = (std::min)(t.batch * 2, t.max_batch);
+		else if (!backlog)
+			t.batch = (std::max)(t.batch / 2, (size_t)1);
+		if (t.cost_ns > 0)
+		{
+			double fit = (double)t.latency_target * 1000 / t.cost_ns;
+			if (fit < t.batch)
+				t.batch = (std::max)((size_t)fit, (size_t)1);
+		}
+	}
+
+	//insert by priority and replay the topic's history to the new callback
+	bool addCallback(const std::string &topic, const BaseSubCallbackPtr &callback_ptr)
+	{
+		DispatchContext &ctx = context();
+		std::vector<BaseMsgPtr> replay;
+		TopicPtr t;
+		bool claimed = false;
+		{
+			std::unique_lock<Mutex> lk(mtx);
+			t = declared(topic);
+			if (!t)
+				return false;
+			if (t->history) {
+				//hold the topic like a dispatcher would, so no newer message overtakes the replay
+				if (!(t->dispatching && t->dispatcher == std::this_thread::get_id())) {
+					//inside a callback this thread holds topics itself, and waiting could deadlock
+					//with a dispatcher subscribing the other way round
+					if (t->dispatching && ctx.depth) {
+						ctx.deferred.push_back(std::make_pair(topic, callback_ptr));
+						return true;
+					}
+					dispatch_cv.wait(lk, [&] { return !t->dispatching; });
+					claim(t);
+					claimed = true;
+				}
+				replay = t->history->snapshot();
+			}
+			std::shared_ptr<std::vector<BaseSubCallbackPtr> > callbacks(
+				t->callbacks ? new std::vector<BaseSubCallbackPtr>(*t->callbacks) : new std::vector<BaseSubCallbackPtr>());
+			//after every callback of equal or higher priority
+			auto pos = std::upper_bound(callbacks->begin(), callbacks->end(), callback_ptr->getpriority(),
+				[](int priority, const BaseSubCallbackPtr &other) { return priority > other->getpriority(); });
+			callbacks->insert(pos, callback_ptr);
+			t->callbacks = callbacks;
+		}
+		if (!claimed)
+			return true;
+		try {
+			for (size_t i = 0; i < replay.size(); ++i)
+			{
+				invoke(callback_ptr, replay[i]);
+			}
+		}
+		catch (...) {
+			unclaim(t);
+			throw;
+		}
+		unclaim(t);
+		addDeferred(ctx);
+		return true;
+	}
+
+	//subscriptions deferred from callbacks, once this thread holds no topic any more
+	void addDeferred(DispatchContext &ctx)
+	{
+		while (!ctx.depth && !ctx.deferred.empty())
+		{
+			std::vector<std::pair<std::string, BaseSubCallbackPtr> > deferred;
+			deferred.swap(ctx.deferred);
+			for (size_t i = 0; i < deferred.size(); ++i)
+			{
+				addCallback(deferred[i].first, deferred[i].second);
+			}
+		}
+	}
+
+	void invoke(const BaseSubCallbackPtr &callback, const BaseMsgPtr &msg, bool exclusive = false)
+	{
+		DispatchContext &ctx = context();
+		++ctx.depth;
+		try {
+			if (exclusive)
+				callback->take(msg);
+			else
+				callback->call(msg);
+		}
+		catch (...) {
+			--ctx.depth;
+			flush(ctx);
+			throw;
+		}
+		--ctx.depth;
+		flush(ctx);
+	}
+
+	//move what real-time publishers produced into their queues, leaving values in the ring once
+	//the queue holds a ring's worth so a lagging topic shows up as failed real-time publishes;
+	//publishers nobody else holds any more are dropped once empty
+	void drainRt(DispatchContext &ctx)
+	{
+		{
+			std::lock_guard<Mutex> lg(mtx);
+			if (rt_channels.empty())
+				return;
+			for (size_t i = 0; i < rt_channels.size();)
+			{
+				if (rt_channels[i].second.use_count() == 1 && rt_channels[i].second->empty()) {
+					rt_channels.erase(rt_channels.begin() + i);
+					continue;
+				}
+				ctx.rt_drain.push_back(std::make_pair(rt_channels[i].second, route(getTopic(rt_channels[i].first))));
+				++i;
+			}
+		}
+		for (size_t i = 0; i < ctx.rt_drain.size(); ++i)
+		{
+			InFlight hold(ctx.rt_drain[i].second);
+			BaseRtChannel &channel = *ctx.rt_drain[i].first;
+			Queue &queue = *ctx.rt_drain[i].second.queue;
+			if (!channel.tryLock())
+				continue;
+			size_t queued = queue.size();
+			for (size_t room = channel.capacity() > queued ? channel.capacity() - queued : 0; room; --room)
+			{
+				BaseMsgPtr msg = channel.pop();
+				if (!msg)
+					break;
+				//this thread may be the one that has to drain a full Block budget
+				if (!queue.enqueue(msg, Admission::NoWait))
+					channel.countRefused();
+			}
+			channel.unlock();
+		}
+		ctx.rt_drain.clear();
+	}
+
+	//Enqueue what callbacks published, resolving all topics under a single lock. The thread
+	//still holds its topic claims, and a Block budget may only be freed by dispatching them,
+	//so a message that does not fit is refused instead of waited for.
+	void flush(DispatchContext &ctx)
+	{
+		if (ctx.depth || ctx.pending.empty())
+			return;
+		{
+			std::lock_guard<Mutex> lg(mtx);
+			for (size_t i = 0; i < ctx.pending.size(); ++i)
+			{
+				ctx.pending_routes.push_back(findRoute(ctx.pending[i].first));
+			}
+		}
+		for (size_t i = 0; i < ctx.pending.size(); ++i)
+		{
+			InFlight hold(ctx.pending_routes[i]);
+			if (ctx.pending_routes[i].queue)
+				deliver(ctx, ctx.pending_routes[i], ctx.pending[i].second, Admission::NoWait);
+		}
+		ctx.pending.clear();
+		ctx.pending_routes.clear();
 	}
 
 private:
-	std::mutex mtx;
-	std::map<std::string, MsgQueuePtr> msg_queues;
-	std::map<std::string, std::list<BaseSubCallbackPtr> > msg_callbacks;
+	uint64_t instance_id;
+	Mutex mtx;
+	Condition dispatch_cv;
+	MemoryBudgetPtr global_budget;
+	MemoryResourcePtr default_resource;
+	std::map<std::string, TopicPtr> topics;
+	std::vector<std::pair<std::string, BaseRtChannelPtr> > rt_channels;
+	std::map<std::string, RateLimiterPtr> publisher_limits;
+	bool strict;
+	size_t delayed_count;
+	uint64_t delay_seq;
+	size_t delay_limit;
+	typename Policy::template Atomic<size_t> dispatchers;
+	//rings advertised from now on are prefaulted, see BrokerConfig::prefault
+	bool prefault_storage;
+	//where the next capped runOnce() starts claiming
+	std::string next_topic;
 };
-
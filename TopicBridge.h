@@ -0,0 +1,507 @@
+#pragma once
+#include "ThreadSafeMsgQueue.h"
+#include <deque>
+#include <map>
+#include <string>
+#include <cerrno>
+#include <cstring>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+//Forwarding of topics between brokers over a stream socket, with credit-based flow control.
+//The receiver grants message and byte credits; the sender only writes frames it has credit
+//for, batching as many as fit into one write. The receiver returns credit after it has
+//published what it read, so a lagging receiver (e.g. a topic blocked on its memory budget)
+//stops the sender, whose bounded outbox in turn blocks its own dispatch. Memory stays bounded
+//end to end. Frames use host byte order and are meant for local (Unix domain) sockets.
+namespace bridge
+{
+	enum
+	{
+		DATA = 1,
+		CREDIT = 2
+	};
+
+	//DATA: followed by topic_len bytes of topic and payload_len bytes of payload
+	struct DataHeader
+	{
+		uint32_t type;
+		uint32_t topic_len;
+		uint32_t payload_len;
+		int32_t priority;
+		uint64_t id;
+	};
+
+	struct CreditFrame
+	{
+		uint32_t type;
+		uint32_t messages;
+		uint64_t bytes;
+	};
+
+	inline bool writeAll(int fd, const char *data, size_t len)
+	{
+		while (len)
+		{
+			ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				return false;
+			data += n;
+			len -= n;
+		}
+		return true;
+	}
+
+	//false on error or end of stream
+	inline bool readAll(int fd, char *data, size_t len)
+	{
+		while (len)
+		{
+			ssize_t n = recv(fd, data, len, 0);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+				return false;
+			data += n;
+			len -= n;
+		}
+		return true;
+	}
+
+	inline bool unixAddress(const std::string &path, sockaddr_un &addr)
+	{
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		if (path.size() >= sizeof(addr.sun_path))
+			return false;
+		memcpy(addr.sun_path, path.c_str(), path.size());
+		return true;
+	}
+
+	//listening socket at path (replacing a stale one), -1 on failure
+	inline int listenUnix(const std::string &path)
+	{
+		sockaddr_un addr;
+		if (!unixAddress(path, addr))
+			return -1;
+		int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd < 0)
+			return -1;
+		unlink(path.c_str());
+		if (bind(fd, (sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 4) != 0)
+		{
+			close(fd);
+			return -1;
+		}
+		return fd;
+	}
+
+	inline int connectUnix(const std::string &path)
+	{
+		sockaddr_un addr;
+		if (!unixAddress(path, addr))
+			return -1;
+		int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd < 0)
+			return -1;
+		if (connect(fd, (sockaddr *)&addr, sizeof(addr)) != 0)
+		{
+			close(fd);
+			return -1;
+		}
+		return fd;
+	}
+}
+
+class BridgeSender;
+using BridgeSenderPtr = std::shared_ptr<BridgeSender>;
+
+//Sending end: forwards messages of local topics, written only within the receiver's credit.
+//Takes ownership of fd.
+class BridgeSender
+{
+public:
+	//outbox_bytes bounds the frames waiting for credit; a full outbox blocks the dispatching callback
+	BridgeSender(ThreadSafeMsgQueuePtr _broker, int fd, size_t outbox_bytes = 4 << 20) : broker(_broker), state(new State(fd, outbox_bytes))
+	{
+	}
+	~BridgeSender()
+	{
+		stop();
+	}
+	BridgeSender(const BridgeSender &) = delete;
+	BridgeSender &operator=(const BridgeSender &) = delete;
+
+	//forward topic's messages; T must be serializable (see MsgSerializeTrait)
+	template <typename T>
+	void forward(std::string topic)
+	{
+		static_assert(MsgSerializeTrait<T>::enabled, "bridged payloads must be serializable");
+		std::weak_ptr<State> weak = state;
+		broker->subscribe<T>(topic, [weak, topic](const MsgPtr<T> msg) {
+			std::shared_ptr<State> s = weak.lock();
+			if (s)
+				s->push(topic, msg);
+		});
+	}
+
+	//messages forwarded before start() wait in the outbox
+	void start()
+	{
+		std::lock_guard<std::mutex> lg(state->mtx);
+		if (state->started || state->closed)
+			return;
+		state->started = true;
+		reader = std::thread(&State::readCredits, state.get());
+		writer = std::thread(&State::writeFrames, state.get());
+	}
+
+	//closes the connection; messages still in the outbox are discarded
+	void stop()
+	{
+		{
+			std::lock_guard<std::mutex> lg(state->mtx);
+			state->closed = true;
+			if (state->fd >= 0)
+				shutdown(state->fd, SHUT_RDWR);
+		}
+		state->cv.notify_all();
+		if (reader.joinable())
+			reader.join();
+		if (writer.joinable())
+			writer.join();
+		std::lock_guard<std::mutex> lg(state->mtx);
+		if (state->fd >= 0)
+			close(state->fd);
+		state->fd = -1;
+		state->outbox.clear();
+		state->queued_bytes = 0;
+	}
+
+	uint64_t sent() const
+	{
+		return state->sent_count;
+	}
+
+	//writes that carried a batch of frames
+	uint64_t batches() const
+	{
+		return state->batch_count;
+	}
+
+	//messages that could not be serialized or exceed the receiver's byte window
+	uint64_t dropped() const
+	{
+		return state->drop_count;
+	}
+
+	//frames waiting for credit
+	size_t pending()
+	{
+		std::lock_guard<std::mutex> lg(state->mtx);
+		return state->outbox.size();
+	}
+
+private:
+	//shared with subscription callbacks, which outlive the sender
+	struct State
+	{
+		State(int _fd, size_t _outbox_limit) : fd(_fd),
+											   started(false),
+											   closed(_fd < 0),
+											   outbox_limit(_outbox_limit),
+											   queued_bytes(0),
+											   credit_messages(0),
+											   credit_bytes(0),
+											   window_bytes(0),
+											   sent_count(0),
+											   batch_count(0),
+											   drop_count(0)
+		{
+		}
+
+		void push(const std::string &topic, const BaseMsgPtr &msg)
+		{
+			std::string frame(sizeof(bridge::DataHeader) + topic.size(), '\0');
+			if (!msg->serialize(frame))
+			{
+				++drop_count;
+				return;
+			}
+			bridge::DataHeader header;
+			header.type = bridge::DATA;
+			header.topic_len = topic.size();
+			header.payload_len = frame.size() - sizeof(header) - topic.size();
+			header.priority = msg->getpriority();
+			header.id = msg->getid();
+			memcpy(&frame[0], &header, sizeof(header));
+			memcpy(&frame[sizeof(header)], topic.data(), topic.size());
+
+			std::unique_lock<std::mutex> lk(mtx);
+			if (window_bytes && frame.size() > window_bytes)
+			{
+				++drop_count;
+				return;
+			}
+			cv.wait(lk, [&] { return closed || queued_bytes + frame.size() <= outbox_limit || outbox.empty(); });
+			if (closed)
+				return;
+			queued_bytes += frame.size();
+			outbox.push_back(std::move(frame));
+			cv.notify_all();
+		}
+
+		void readCredits()
+		{
+			bridge::CreditFrame credit;
+			while (bridge::readAll(fd, (char *)&credit, sizeof(credit)) && credit.type == bridge::CREDIT)
+			{
+				std::lock_guard<std::mutex> lg(mtx);
+				//the first grant is the receiver's whole window
+				if (!window_bytes)
+				{
+					window_bytes = credit.bytes;
+					dropOversized();
+				}
+				credit_messages += credit.messages;
+				credit_bytes += credit.bytes;
+				cv.notify_all();
+			}
+			std::lock_guard<std::mutex> lg(mtx);
+			closed = true;
+			cv.notify_all();
+		}
+
+		//frames queued before the window was known that could never get credit; caller holds mtx
+		void dropOversized()
+		{
+			for (auto itr = outbox.begin(); itr != outbox.end();)
+			{
+				if (itr->size() <= window_bytes)
+				{
+					++itr;
+					continue;
+				}
+				queued_bytes -= itr->size();
+				itr = outbox.erase(itr);
+				++drop_count;
+			}
+		}
+
+		void writeFrames()
+		{
+			std::string batch;
+			std::unique_lock<std::mutex> lk(mtx);
+			while (true)
+			{
+				cv.wait(lk, [&] { return closed || (!outbox.empty() && credit_messages && outbox.front().size() <= credit_bytes); });
+				if (closed)
+					return;
+				batch.clear();
+				size_t count = 0;
+				while (!outbox.empty() && credit_messages && outbox.front().size() <= credit_bytes)
+				{
+					std::string &frame = outbox.front();
+					--credit_messages;
+					credit_bytes -= frame.size();
+					queued_bytes -= frame.size();
+					batch.append(frame);
+					outbox.pop_front();
+					++count;
+				}
+				cv.notify_all();
+				lk.unlock();
+				bool ok = bridge::writeAll(fd, batch.data(), batch.size());
+				lk.lock();
+				if (!ok)
+				{
+					closed = true;
+					cv.notify_all();
+					return;
+				}
+				sent_count += count;
+				++batch_count;
+			}
+		}
+
+		std::mutex mtx;
+		std::condition_variable cv;
+		int fd;
+		bool started;
+		//stopped or the connection failed; forwarded messages are discarded from then on
+		bool closed;
+		std::deque<std::string> outbox;
+		size_t outbox_limit;
+		size_t queued_bytes;
+		uint64_t credit_messages;
+		uint64_t credit_bytes;
+		uint64_t window_bytes;
+		std::atomic<uint64_t> sent_count;
+		std::atomic<uint64_t> batch_count;
+		std::atomic<uint64_t> drop_count;
+	};
+
+private:
+	ThreadSafeMsgQueuePtr broker;
+	std::shared_ptr<State> state;
+	std::thread reader;
+	std::thread writer;
+};
+
+class BridgeReceiver;
+using BridgeReceiverPtr = std::shared_ptr<BridgeReceiver>;
+
+//Receiving end: republishes bridged messages on the local broker and grants credit for what it
+//has published. At most window_messages / window_bytes are in flight. Takes ownership of fd.
+class BridgeReceiver
+{
+public:
+	BridgeReceiver(ThreadSafeMsgQueuePtr _broker, int _fd, uint32_t _window_messages = 1024, uint64_t _window_bytes = 4 << 20) : broker(_broker),
+																															  fd(_fd),
+																															  running(false),
+																															  window_messages(_window_messages),
+																															  window_bytes(_window_bytes),
+																															  received_count(0),
+																															  unknown_count(0)
+	{
+	}
+	~BridgeReceiver()
+	{
+		stop();
+	}
+	BridgeReceiver(const BridgeReceiver &) = delete;
+	BridgeReceiver &operator=(const BridgeReceiver &) = delete;
+
+	//republish topic locally as Msg<T>; frames of topics nobody accepted are dropped
+	template <typename T>
+	void accept(std::string topic)
+	{
+		static_assert(MsgSerializeTrait<T>::enabled, "bridged payloads must be serializable");
+		Route route;
+		route.loader = &Msg<T>::load;
+		ThreadSafeMsgQueuePtr b = broker;
+		route.publish = [b](const std::string &name, const BaseMsgPtr &msg) {
+			return b->publish<T>(name, std::static_pointer_cast<Msg<T> >(msg));
+		};
+		std::lock_guard<std::mutex> lg(mtx);
+		routes[topic] = route;
+	}
+
+	void start()
+	{
+		std::lock_guard<std::mutex> lg(mtx);
+		if (running || fd < 0)
+			return;
+		running = true;
+		reader = std::thread(&BridgeReceiver::receive, this);
+	}
+
+	void stop()
+	{
+		{
+			std::lock_guard<std::mutex> lg(mtx);
+			running = false;
+			if (fd >= 0)
+				shutdown(fd, SHUT_RDWR);
+		}
+		if (reader.joinable())
+			reader.join();
+		if (fd >= 0)
+			close(fd);
+		fd = -1;
+	}
+
+	uint64_t received() const
+	{
+		return received_count;
+	}
+
+	//frames for topics without accept()
+	uint64_t unknown() const
+	{
+		return unknown_count;
+	}
+
+private:
+	struct Route
+	{
+		MsgLoader loader;
+		std::function<bool(const std::string &, const BaseMsgPtr &)> publish;
+	};
+
+	bool grant(uint32_t messages, uint64_t bytes)
+	{
+		bridge::CreditFrame credit;
+		credit.type = bridge::CREDIT;
+		credit.messages = messages;
+		credit.bytes = bytes;
+		return bridge::writeAll(fd, (const char *)&credit, sizeof(credit));
+	}
+
+	void receive()
+	{
+		if (!grant(window_messages, window_bytes))
+			return;
+		uint32_t consumed_messages = 0;
+		uint64_t consumed_bytes = 0;
+		std::string topic;
+		std::string payload;
+		bridge::DataHeader header;
+		while (bridge::readAll(fd, (char *)&header, sizeof(header)) && header.type == bridge::DATA)
+		{
+			topic.resize(header.topic_len);
+			payload.resize(header.payload_len);
+			if (!bridge::readAll(fd, &topic[0], topic.size()) || !bridge::readAll(fd, &payload[0], payload.size()))
+				break;
+			Route route;
+			bool found;
+			{
+				std::lock_guard<std::mutex> lg(mtx);
+				auto itr = routes.find(topic);
+				found = itr != routes.end();
+				if (found)
+					route = itr->second;
+			}
+			if (found)
+			{
+				BaseMsgPtr msg = route.loader(payload.data(), payload.size(), header.priority);
+				msg->setid(header.id);
+				//may block on the local topic's budget, holding back credit
+				route.publish(topic, msg);
+				++received_count;
+			}
+			else
+			{
+				++unknown_count;
+			}
+			++consumed_messages;
+			consumed_bytes += sizeof(header) + topic.size() + payload.size();
+			//return credit in batches, or as soon as the sender has nothing more on the way
+			int unread = 0;
+			ioctl(fd, FIONREAD, &unread);
+			if (consumed_messages >= window_messages / 2 || consumed_bytes >= window_bytes / 2 || unread == 0)
+			{
+				if (!grant(consumed_messages, consumed_bytes))
+					break;
+				consumed_messages = 0;
+				consumed_bytes = 0;
+			}
+		}
+	}
+
+private:
+	ThreadSafeMsgQueuePtr broker;
+	std::mutex mtx;
+	int fd;
+	bool running;
+	uint32_t window_messages;
+	uint64_t window_bytes;
+	std::map<std::string, Route> routes;
+	std::thread reader;
+	std::atomic<uint64_t> received_count;
+	std::atomic<uint64_t> unknown_count;
+};
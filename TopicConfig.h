@@ -0,0 +1,395 @@
+#pragma once
+#include "MsgQueue.h"
+#include "RateLimiter.h"
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <cstdlib>
+#include <sched.h>
+
+//ordering discipline of a topic's queue
+enum class QueueKind
+{
+	Ordered, //MsgQueue: strict priority order, FIFO while priorities are equal
+	Relaxed, //RelaxedMsgQueue: approximate priority order for contended topics
+	Deadline //EdfMsgQueue: earliest deadline first
+};
+
+//memory resource of a topic's queue heap and of messages from ThreadSafeMsgQueue::make(); the
+//broker's topic and subscriber maps and std::function callbacks still use operator new
+enum class AllocatorKind
+{
+	Default,  //the broker's; for the broker itself operator new
+	Pool,	  //PoolResource: size-class free lists, for long-lived topics
+	Monotonic //MonotonicResource: bump allocation for request-scoped topics, see ThreadSafeMsgQueue::resetArena
+};
+
+//Everything the broker would otherwise create lazily for a topic on its first publish.
+struct TopicConfig
+{
+	explicit TopicConfig(const std::string &_name = "") : name(_name),
+														  queue(QueueKind::Ordered),
+														  relaxed_threads(0),
+														  drop_missed(false),
+														  capacity(0),
+														  huge_pages(false),
+														  budget(0),
+														  overflow(OverflowPolicy::Block),
+														  history_depth(0),
+														  dedup_window_us(0),
+														  dedup_expected_ids(1 << 16),
+														  latency_target_us(0),
+														  max_batch(256),
+														  aqm_target_us(0),
+														  aqm_interval_us(100000),
+														  aqm_mark(false),
+														  rate_limit(0),
+														  rate_burst(1),
+														  rate_policy(RateLimitPolicy::Drop),
+														  allocator(AllocatorKind::Default),
+														  arena_bytes(0)
+	{
+	}
+
+	std::string name;
+	QueueKind queue;
+	//threads a relaxed queue is sized for, 0 = one per core
+	size_t relaxed_threads;
+	//a deadline queue discards messages whose deadline passed while queued
+	bool drop_missed;
+	//messages preallocated at startup
+	size_t capacity;
+	bool huge_pages;
+	//byte budget of the topic, 0 = unlimited
+	size_t budget;
+	OverflowPolicy overflow;
+	size_t history_depth;
+	//0 disables duplicate suppression
+	int64_t dedup_window_us;
+	size_t dedup_expected_ids;
+	//adaptive dispatch batching, see ThreadSafeMsgQueue::setLatencyTarget; 0 = one message per round
+	int64_t latency_target_us;
+	size_t max_batch;
+	//CoDel, see MsgQueue::setAqm; 0 disables
+	int64_t aqm_target_us;
+	int64_t aqm_interval_us;
+	bool aqm_mark;
+	//messages per second, 0 = unlimited; see ThreadSafeMsgQueue::setRateLimit
+	double rate_limit;
+	double rate_burst;
+	RateLimitPolicy rate_policy;
+	AllocatorKind allocator;
+	//first block of a monotonic arena, 0 = 64K
+	size_t arena_bytes;
+};
+
+struct BrokerConfig
+{
+	BrokerConfig() : memory_budget(0), strict(false), min_workers(1), max_workers(0), sched_policy(-1), sched_priority(0), no_alloc_after(0), allocator(AllocatorKind::Default), arena_bytes(0), lock_memory(false), prefault(false), prefault_stack(0), prefault_heap(0) {}
+
+	//byte budget across all topics, 0 = unlimited
+	size_t memory_budget;
+	//publish(), subscribe() and per-topic settings on a topic that was not declared fail instead
+	//of creating it
+	bool strict;
+	std::vector<TopicConfig> topics;
+	//dispatcher pool started with the broker, see DispatcherPoolConfig; max_workers 0 = one per core
+	size_t min_workers;
+	size_t max_workers;
+	int sched_policy;
+	int sched_priority;
+	size_t no_alloc_after;
+	//resource shared by topics without their own; Default keeps the broker's current one
+	AllocatorKind allocator;
+	size_t arena_bytes;
+	//real-time mode applied by startBroker(): mlockall, touch reserved queue storage, real-time
+	//rings and their pools (also those advertised later), and prefault this much stack and heap
+	bool lock_memory;
+	bool prefault;
+	size_t prefault_stack;
+	size_t prefault_heap;
+};
+
+//Reads a BrokerConfig from an ini-style text:
+//
+//	[broker]
+//	memory_budget = 64M
+//	strict = true
+//	min_workers = 2
+//	lock_memory = true
+//	prefault = true
+//
+//	[topic pose]
+//	queue = relaxed
+//	capacity = 4096
+//	budget = 1M
+//	overflow = drop_oldest
+//	allocator = pool
+//
+//Sizes accept K/M/G suffixes, '#' starts a comment. On error returns false and sets error to
+//"line N: reason".
+class BrokerConfigParser
+{
+public:
+	static bool parse(std::istream &in, BrokerConfig &config, std::string *error = nullptr)
+	{
+		std::string line;
+		int line_no = 0;
+		TopicConfig *topic = nullptr;
+		bool in_broker = false;
+		while (std::getline(in, line))
+		{
+			++line_no;
+			line = trim(line.substr(0, line.find('#')));
+			if (line.empty())
+				continue;
+			if (line[0] == '[')
+			{
+				if (line[line.size() - 1] != ']')
+					return fail(error, line_no, "unterminated section");
+				std::string section = trim(line.substr(1, line.size() - 2));
+				topic = nullptr;
+				in_broker = section == "broker";
+				if (!in_broker)
+				{
+					if (section.compare(0, 6, "topic ") != 0 && section != "topic")
+						return fail(error, line_no, "unknown section '" + section + "'");
+					config.topics.push_back(TopicConfig(section.size() > 6 ? trim(section.substr(6)) : ""));
+					topic = &config.topics.back();
+				}
+				continue;
+			}
+			size_t eq = line.find('=');
+			if (eq == std::string::npos)
+				return fail(error, line_no, "expected key = value");
+			std::string key = trim(line.substr(0, eq));
+			std::string value = trim(line.substr(eq + 1));
+			bool ok;
+			if (topic)
+				ok = setTopic(*topic, key, value);
+			else if (in_broker)
+				ok = setBroker(config, key, value);
+			else
+				return fail(error, line_no, "key outside a section");
+			if (!ok)
+				return fail(error, line_no, "bad value for '" + key + "'");
+		}
+		return true;
+	}
+
+	static bool load(const std::string &path, BrokerConfig &config, std::string *error = nullptr)
+	{
+		std::ifstream in(path.c_str());
+		if (!in)
+		{
+			if (error)
+				*error = "cannot open " + path;
+			return false;
+		}
+		return parse(in, config, error);
+	}
+
+private:
+	static bool setTopic(TopicConfig &topic, const std::string &key, const std::string &value)
+	{
+		if (key == "queue")
+		{
+			if (value == "ordered")
+				topic.queue = QueueKind::Ordered;
+			else if (value == "relaxed")
+				topic.queue = QueueKind::Relaxed;
+			else if (value == "deadline")
+				topic.queue = QueueKind::Deadline;
+			else
+				return false;
+			return true;
+		}
+		if (key == "overflow")
+		{
+			if (value == "block")
+				topic.overflow = OverflowPolicy::Block;
+			else if (value == "drop_newest")
+				topic.overflow = OverflowPolicy::DropNewest;
+			else if (value == "drop_oldest")
+				topic.overflow = OverflowPolicy::DropOldest;
+			else if (value == "spill")
+				topic.overflow = OverflowPolicy::Spill;
+			else
+				return false;
+			return true;
+		}
+		if (key == "huge_pages")
+			return toBool(value, topic.huge_pages);
+		if (key == "allocator")
+			return toAllocator(value, topic.allocator);
+		if (key == "drop_missed")
+			return toBool(value, topic.drop_missed);
+		if (key == "aqm_mark")
+			return toBool(value, topic.aqm_mark);
+		if (key == "rate_limit")
+			return toDouble(value, topic.rate_limit);
+		if (key == "rate_burst")
+			return toDouble(value, topic.rate_burst);
+		if (key == "rate_policy")
+		{
+			if (value == "drop")
+				topic.rate_policy = RateLimitPolicy::Drop;
+			else if (value == "block")
+				topic.rate_policy = RateLimitPolicy::Block;
+			else if (value == "delay")
+				topic.rate_policy = RateLimitPolicy::Delay;
+			else
+				return false;
+			return true;
+		}
+		uint64_t n;
+		if (!toSize(value, n))
+			return false;
+		if (key == "relaxed_threads")
+			topic.relaxed_threads = n;
+		else if (key == "capacity")
+			topic.capacity = n;
+		else if (key == "budget")
+			topic.budget = n;
+		else if (key == "history")
+			topic.history_depth = n;
+		else if (key == "dedup_window_us")
+			topic.dedup_window_us = n;
+		else if (key == "dedup_expected_ids")
+			topic.dedup_expected_ids = n;
+		else if (key == "latency_target_us")
+			topic.latency_target_us = n;
+		else if (key == "max_batch")
+			topic.max_batch = n;
+		else if (key == "aqm_target_us")
+			topic.aqm_target_us = n;
+		else if (key == "aqm_interval_us")
+			topic.aqm_interval_us = n;
+		else if (key == "arena_bytes")
+			topic.arena_bytes = n;
+		else
+			return false;
+		return true;
+	}
+
+	static bool setBroker(BrokerConfig &config, const std::string &key, const std::string &value)
+	{
+		if (key == "strict")
+			return toBool(value, config.strict);
+		if (key == "sched_policy")
+			return toSchedPolicy(value, config.sched_policy);
+		if (key == "allocator")
+			return toAllocator(value, config.allocator);
+		if (key == "lock_memory")
+			return toBool(value, config.lock_memory);
+		if (key == "prefault")
+			return toBool(value, config.prefault);
+		uint64_t n;
+		if (!toSize(value, n))
+			return false;
+		if (key == "memory_budget")
+			config.memory_budget = n;
+		else if (key == "min_workers")
+			config.min_workers = n;
+		else if (key == "max_workers")
+			config.max_workers = n;
+		else if (key == "sched_priority")
+			config.sched_priority = (int)n;
+		else if (key == "no_alloc_after")
+			config.no_alloc_after = n;
+		else if (key == "arena_bytes")
+			config.arena_bytes = n;
+		else if (key == "prefault_stack")
+			config.prefault_stack = n;
+		else if (key == "prefault_heap")
+			config.prefault_heap = n;
+		else
+			return false;
+		return true;
+	}
+
+	static bool toSize(const std::string &value, uint64_t &n)
+	{
+		if (value.empty() || value[0] < '0' || value[0] > '9')
+			return false;
+		char *end = nullptr;
+		n = strtoull(value.c_str(), &end, 10);
+		std::string suffix = trim(end);
+		if (suffix == "K" || suffix == "k")
+			n <<= 10;
+		else if (suffix == "M" || suffix == "m")
+			n <<= 20;
+		else if (suffix == "G" || suffix == "g")
+			n <<= 30;
+		else if (!suffix.empty())
+			return false;
+		return true;
+	}
+
+	static bool toDouble(const std::string &value, double &d)
+	{
+		char *end = nullptr;
+		d = strtod(value.c_str(), &end);
+		return end != value.c_str() && !*end && d >= 0;
+	}
+
+	static bool toBool(const std::string &value, bool &b)
+	{
+		if (value == "true" || value == "1" || value == "yes")
+			b = true;
+		else if (value == "false" || value == "0" || value == "no")
+			b = false;
+		else
+			return false;
+		return true;
+	}
+
+	static bool toAllocator(const std::string &value, AllocatorKind &kind)
+	{
+		if (value == "default")
+			kind = AllocatorKind::Default;
+		else if (value == "pool")
+			kind = AllocatorKind::Pool;
+		else if (value == "monotonic")
+			kind = AllocatorKind::Monotonic;
+		else
+			return false;
+		return true;
+	}
+
+	static bool toSchedPolicy(const std::string &value, int &policy)
+	{
+		if (value == "fifo")
+			policy = SCHED_FIFO;
+		else if (value == "rr")
+			policy = SCHED_RR;
+		else if (value == "other")
+			policy = SCHED_OTHER;
+		else if (value == "default")
+			policy = -1;
+		else
+			return false;
+		return true;
+	}
+
+	static std::string trim(const std::string &s)
+	{
+		size_t begin = s.find_first_not_of(" \t\r\n");
+		if (begin == std::string::npos)
+			return "";
+		size_t end = s.find_last_not_of(" \t\r\n");
+		return s.substr(begin, end - begin + 1);
+	}
+
+	static bool fail(std::string *error, int line_no, const std::string &reason)
+	{
+		if (error)
+		{
+			std::ostringstream os;
+			os << "line " << line_no << ": " << reason;
+			*error = os.str();
+		}
+		return false;
+	}
+};
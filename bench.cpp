@@ -0,0 +1,250 @@
+#include "ThreadSafeMsgQueue.h"
+#include "RelaxedMsgQueue.h"
+#include "MsgPool.h"
+#include <cstdio>
+#include <cstring>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cstdlib>
+#include <random>
+#include <vector>
+#include <string>
+
+typedef std::chrono::steady_clock BenchClock;
+
+static double secondsSince(BenchClock::time_point begin)
+{
+	return std::chrono::duration<double>(BenchClock::now() - begin).count();
+}
+
+//push/pop pairs from every thread against a prefilled queue, million operations per second
+double benchPriorityThroughput(MsgQueuePtr queue, int threads, int ops_per_thread)
+{
+	std::mt19937 rng(1);
+	for (int i = 0; i < 10000; ++i)
+		queue->enqueue(BaseMsgPtr(new Msg<int>(i, rng() % 1000)));
+
+	std::vector<BaseMsgPtr> msgs;
+	for (int i = 0; i < threads * ops_per_thread; ++i)
+		msgs.push_back(BaseMsgPtr(new Msg<int>(i, rng() % 1000)));
+
+	std::vector<std::thread> workers;
+	auto begin = BenchClock::now();
+	for (int t = 0; t < threads; ++t)
+	{
+		workers.push_back(std::thread([&, t] {
+			for (int i = 0; i < ops_per_thread; ++i)
+			{
+				queue->enqueue(msgs[t * ops_per_thread + i]);
+				queue->dequeue();
+			}
+		}));
+	}
+	for (size_t i = 0; i < workers.size(); ++i)
+		workers[i].join();
+	double seconds = secondsSince(begin);
+	while (queue->dequeue())
+		;
+	return 2.0 * threads * ops_per_thread / seconds / 1e6;
+}
+
+//drain a prefilled queue concurrently; the rank error of a pop is the number of
+//still-queued messages that a strict priority queue would have returned first
+void benchRankError(MsgQueuePtr queue, int threads, int count, double &mean, int &worst)
+{
+	std::mt19937 rng(2);
+	std::vector<BaseMsgPtr> msgs;
+	for (int i = 0; i < count; ++i)
+	{
+		msgs.push_back(BaseMsgPtr(new Msg<int>(i, rng() % 1000)));
+		queue->enqueue(msgs.back());
+	}
+	std::vector<BaseMsgPtr> ideal(msgs);
+	std::sort(ideal.begin(), ideal.end(), [](const BaseMsgPtr &a, const BaseMsgPtr &b) { return *b < *a; });
+	std::vector<int> rank(count);
+	for (int i = 0; i < count; ++i)
+		rank[std::static_pointer_cast<Msg<int> >(ideal[i])->getContent()] = i;
+
+	std::vector<int> order(count);
+	std::atomic<int> popped(0);
+	std::vector<std::thread> workers;
+	for (int t = 0; t < threads; ++t)
+	{
+		workers.push_back(std::thread([&] {
+			while (BaseMsgPtr msg = queue->dequeue())
+				order[popped++] = std::static_pointer_cast<Msg<int> >(msg)->getContent();
+		}));
+	}
+	for (size_t i = 0; i < workers.size(); ++i)
+		workers[i].join();
+
+	//fenwick tree over ideal ranks of the messages not popped yet
+	std::vector<int> tree(count + 1, 0);
+	for (int i = 1; i <= count; ++i)
+	{
+		tree[i] += 1;
+		if (i + (i & -i) <= count)
+			tree[i + (i & -i)] += tree[i];
+	}
+	double total = 0;
+	worst = 0;
+	for (int i = 0; i < count; ++i)
+	{
+		int r = rank[order[i]];
+		int before = 0;
+		for (int k = r; k > 0; k -= k & -k)
+			before += tree[k];
+		for (int k = r + 1; k <= count; k += k & -k)
+			tree[k] -= 1;
+		total += before;
+		worst = (std::max)(worst, before);
+	}
+	mean = total / count;
+}
+
+void benchPriority(int threads)
+{
+	printf("== priority queues, %d threads ==\n", threads);
+	const char *names[] = {"MsgQueue", "RelaxedMsgQueue"};
+	for (int kind = 0; kind < 2; ++kind)
+	{
+		MsgQueuePtr queue = kind ? MsgQueuePtr(new RelaxedMsgQueue(threads)) : MsgQueuePtr(new MsgQueue());
+		double mops = benchPriorityThroughput(queue, threads, 50000);
+		double mean = 0;
+		int worst = 0;
+		benchRankError(queue, threads, 100000, mean, worst);
+		printf("%-16s %8.2f Mops/s  rank error mean %8.2f max %6d\n", names[kind], mops, mean, worst);
+	}
+}
+
+//dTLB load misses of the calling thread; -1 when perf events are not permitted
+class DtlbCounter
+{
+public:
+	DtlbCounter() : fd(-1)
+	{
+		perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = PERF_TYPE_HW_CACHE;
+		attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+		attr.disabled = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		fd = (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+	}
+	~DtlbCounter()
+	{
+		if (fd >= 0)
+			close(fd);
+	}
+
+	void start()
+	{
+		if (fd < 0)
+			return;
+		ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+		ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+	}
+
+	long long stop()
+	{
+		long long count = -1;
+		if (fd < 0)
+			return count;
+		ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+		if (read(fd, &count, sizeof(count)) != sizeof(count))
+			count = -1;
+		return count;
+	}
+
+private:
+	int fd;
+};
+
+//fill a large queue from a message pool and drain it, with queue chunks and pool on 4 KiB or 2 MiB pages
+void benchHugePages(size_t count)
+{
+	printf("== huge pages, %zu queued messages ==\n", count);
+	for (int huge = 0; huge < 2; ++huge)
+	{
+		MsgPool<int> pool(count, huge != 0);
+		pool.blocks()->prefault();
+		MsgQueue queue;
+		queue.reserve(count, huge != 0);
+		DtlbCounter dtlb;
+		double best = 0;
+		long long misses = -1;
+		for (int round = 0; round < 3; ++round)
+		{
+			dtlb.start();
+			auto begin = BenchClock::now();
+			for (size_t i = 0; i < count; ++i)
+				queue.enqueue(pool.make((int)i));
+			while (queue.dequeue())
+				;
+			double mops = 2.0 * count / secondsSince(begin) / 1e6;
+			long long round_misses = dtlb.stop();
+			if (mops > best)
+			{
+				best = mops;
+				misses = round_misses;
+			}
+		}
+		if (misses < 0)
+			printf("%-16s %8.2f Mops/s  dTLB misses n/a\n", huge ? "2 MiB pages" : "4 KiB pages", best);
+		else
+			printf("%-16s %8.2f Mops/s  dTLB misses %lld (%.3f per message)\n", huge ? "2 MiB pages" : "4 KiB pages", best, misses, (double)misses / count);
+	}
+}
+
+//small messages allocated and freed alone, then through a queue, on each memory resource
+void benchAllocators(int count)
+{
+	printf("== memory resources, %d messages ==\n", count);
+	const char *names[] = {"operator new", "pool", "monotonic"};
+	for (int kind = 0; kind < 3; ++kind)
+	{
+		MemoryResourcePtr resource;
+		if (kind == 1)
+			resource.reset(new PoolResource());
+		else if (kind == 2)
+			resource.reset(new MonotonicResource(1 << 20));
+		std::vector<MsgPtr<int> > held;
+		held.reserve(1000);
+		auto begin = BenchClock::now();
+		for (int round = 0; round < count / 1000; ++round)
+		{
+			for (int i = 0; i < 1000; ++i)
+				held.push_back(makeMsg<int>(resource, i));
+			held.clear();
+			//request-scoped use: the arena is reset once its messages are gone
+			if (kind == 2)
+				std::static_pointer_cast<MonotonicResource>(resource)->release();
+		}
+		double alloc_ns = secondsSince(begin) * 1e9 / count;
+		MsgQueue queue;
+		queue.setMemoryResource(resource);
+		begin = BenchClock::now();
+		for (int round = 0; round < count / 1000; ++round)
+		{
+			for (int i = 0; i < 1000; ++i)
+				queue.enqueue(makeMsg<int>(resource, i, i & 3));
+			while (queue.dequeue())
+				;
+		}
+		printf("%-16s %8.1f ns per alloc+free  %8.2f Mops/s queued\n", names[kind], alloc_ns, 2.0 * count / secondsSince(begin) / 1e6);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	int threads = argc > 1 ? std::atoi(argv[1]) : (std::max)(2u, std::thread::hardware_concurrency());
+	benchPriority(threads);
+	benchHugePages(1 << 18);
+	benchHugePages(1 << 20);
+	benchAllocators(1 << 20);
+	return 0;
+}
@@ -0,0 +1,1482 @@
+#include "DispatcherPool.h"
+#include "ColumnarRecorder.h"
+#include "TopicBridge.h"
+#include "RtAllocHook.h"
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+
+//Minimal test registry: TEST defines and registers a case, CHECK reports a failed condition and
+//carries on. Run all cases, or only those named on the command line.
+typedef void (*TestFn)();
+
+static std::vector<std::pair<const char *, TestFn> > &registry()
+{
+	static std::vector<std::pair<const char *, TestFn> > tests;
+	return tests;
+}
+
+static int failures = 0;
+
+struct TestRegistration
+{
+	TestRegistration(const char *name, TestFn fn)
+	{
+		registry().push_back(std::make_pair(name, fn));
+	}
+};
+
+#define TEST(name)                                            \
+	static void name();                                       \
+	static TestRegistration name##_registration(#name, name); \
+	static void name()
+
+#define CHECK(cond)                                                                  \
+	do                                                                               \
+	{                                                                                \
+		if (!(cond))                                                                 \
+		{                                                                            \
+			++failures;                                                              \
+			fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+		}                                                                            \
+	} while (0)
+
+int main(int argc, char **argv)
+{
+	int run = 0;
+	for (size_t i = 0; i < registry().size(); ++i)
+	{
+		const char *name = registry()[i].first;
+		bool selected = argc < 2;
+		for (int a = 1; a < argc; ++a)
+			selected = selected || strcmp(argv[a], name) == 0;
+		if (!selected)
+			continue;
+		int before = failures;
+		registry()[i].second();
+		printf("%s %s\n", failures == before ? "PASS" : "FAIL", name);
+		++run;
+	}
+	printf("%d tests, %d failed checks\n", run, failures);
+	return failures ? 1 : 0;
+}
+
+static void drain(const ThreadSafeMsgQueuePtr &broker)
+{
+	while (broker->runOnce())
+		;
+}
+
+//lag follows the head of the queue, not the last dequeue
+TEST(headAgeTracksWaitingMessage)
+{
+	MsgQueue queue;
+	CHECK(queue.headAge() == 0);
+	queue.enqueue(MsgPtr<int>(new Msg<int>(1)));
+	std::this_thread::sleep_for(std::chrono::milliseconds(30));
+	CHECK(queue.headAge() >= 30000);
+	queue.dequeue();
+	CHECK(queue.sojourn() >= 30000);
+	queue.enqueue(MsgPtr<int>(new Msg<int>(2)));
+	CHECK(queue.headAge() < 30000);
+	queue.dequeue();
+	CHECK(queue.headAge() == 0);
+}
+
+TEST(brokerLagGrowsWithoutDispatch)
+{
+	ThreadSafeMsgQueuePtr broker = ThreadSafeMsgQueue::getInstance();
+	drain(broker);
+	CHECK(broker->lag() == 0);
+	broker->publish<int>("lag", MsgPtr<int>(new Msg<int>(1)));
+	std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	int64_t first = broker->lag();
+	CHECK(first >= 20000);
+	std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	CHECK(broker->lag() >= first + 20000);
+	drain(broker);
+	CHECK(broker->lag() == 0);
+}
+
+static int intOf(const BaseMsgPtr &msg)
+{
+	return std::static_pointer_cast<Msg<int> >(msg)->getContent();
+}
+
+//FIFO while priorities agree, heap once they differ, FIFO again after a drain
+TEST(fifoUntilMixedPriorities)
+{
+	MsgQueue queue;
+	for (int i = 0; i < 3; ++i)
+		queue.enqueue(MsgPtr<int>(new Msg<int>(i, 5)));
+	CHECK(!queue.isHeap());
+	queue.enqueue(MsgPtr<int>(new Msg<int>(10, 9)));
+	CHECK(queue.isHeap());
+	queue.enqueue(MsgPtr<int>(new Msg<int>(3, 5)));
+	int expected[] = {10, 0, 1, 2, 3};
+	for (int i = 0; i < 5; ++i)
+		CHECK(intOf(queue.dequeue()) == expected[i]);
+	CHECK(!queue.dequeue());
+	CHECK(!queue.isHeap());
+	queue.enqueue(MsgPtr<int>(new Msg<int>(1, 1)));
+	CHECK(!queue.isHeap());
+}
+
+//relaxed order, but every message comes out exactly once under concurrent producers and consumers
+TEST(relaxedQueueDeliversEachMessageOnce)
+{
+	RelaxedMsgQueue queue(4);
+	const int producers = 4, per_producer = 2000;
+	std::vector<std::atomic<int> > seen(producers * per_producer);
+	for (size_t i = 0; i < seen.size(); ++i)
+		seen[i] = 0;
+	std::atomic<int> consumed(0);
+	std::vector<std::thread> threads;
+	for (int p = 0; p < producers; ++p)
+	{
+		threads.push_back(std::thread([&, p] {
+			for (int i = 0; i < per_producer; ++i)
+				queue.enqueue(MsgPtr<int>(new Msg<int>(p * per_producer + i, i % 3)));
+		}));
+	}
+	for (int c = 0; c < 2; ++c)
+	{
+		threads.push_back(std::thread([&] {
+			while (consumed.load() < producers * per_producer)
+			{
+				BaseMsgPtr msg = queue.dequeue();
+				if (!msg)
+					continue;
+				++seen[intOf(msg)];
+				++consumed;
+			}
+		}));
+	}
+	for (size_t i = 0; i < threads.size(); ++i)
+		threads[i].join();
+	bool once = true;
+	for (size_t i = 0; i < seen.size(); ++i)
+		once = once && seen[i] == 1;
+	CHECK(once);
+	CHECK(queue.size() == 0);
+	CHECK(!queue.dequeue());
+}
+
+//swapping a topic's queue while publishing never strands an accepted message in the old queue
+TEST(setQueueDoesNotLosePublishes)
+{
+	ThreadSafeMsgQueuePtr broker = ThreadSafeMsgQueue::getInstance();
+	std::atomic<int> received(0);
+	broker->subscribe<int>("swap", [&](const MsgPtr<int>) { ++received; });
+	std::atomic<int> accepted(0);
+	std::atomic<int> running(4);
+	std::vector<std::thread> publishers;
+	for (int p = 0; p < 4; ++p)
+	{
+		publishers.push_back(std::thread([&] {
+			for (int i = 0; i < 5000; ++i)
+				accepted += broker->publish<int>("swap", MsgPtr<int>(new Msg<int>(i)));
+			--running;
+		}));
+	}
+	std::thread dispatcher([&] {
+		while (running)
+			broker->runOnce();
+	});
+	while (running)
+		broker->setQueue("swap", ThreadSafeMsgQueue::QueuePtr(new MsgQueue()));
+	for (size_t i = 0; i < publishers.size(); ++i)
+		publishers[i].join();
+	dispatcher.join();
+	drain(broker);
+	CHECK(received == accepted);
+}
+
+//no MsgSerializeTrait, so it can never be spilled
+struct Opaque
+{
+	Opaque(int _value = 0) : value(_value) {}
+	virtual ~Opaque() {}
+	int value;
+};
+
+//spilled messages come back in FIFO order with their metadata, and nothing overtakes them
+TEST(spillKeepsOrderAndMetadata)
+{
+	MsgQueue queue;
+	MsgPtr<int> probe(new Msg<int>(0));
+	queue.setBudget(2 * probe->byteSize(), OverflowPolicy::Spill);
+	for (int i = 0; i < 50; ++i)
+	{
+		MsgPtr<int> msg(new Msg<int>(i));
+		msg->setid(1000 + i);
+		msg->setdeadline(i == 30 ? 123456 : 0);
+		msg->setmarked(i == 40);
+		CHECK(queue.enqueue(msg));
+	}
+	CHECK(queue.spilledBytes() > 0);
+	//would jump ahead of everything on disk
+	CHECK(!queue.enqueue(MsgPtr<Opaque>(new Msg<Opaque>(Opaque(99)))));
+	CHECK(queue.dropped() == 1);
+	for (int i = 0; i < 50; ++i)
+	{
+		BaseMsgPtr msg = queue.dequeue();
+		CHECK(msg && intOf(msg) == i);
+		if (!msg)
+			break;
+		CHECK(msg->getid() == (uint64_t)(1000 + i));
+		CHECK(msg->getdeadline() == (i == 30 ? 123456 : 0));
+		CHECK(msg->getmarked() == (i == 40));
+	}
+	CHECK(!queue.dequeue());
+	CHECK(queue.spilledBytes() == 0);
+	//with nothing on disk an unserializable message is kept in memory instead
+	for (int i = 0; i < 3; ++i)
+		CHECK(queue.enqueue(MsgPtr<Opaque>(new Msg<Opaque>(Opaque(i)))));
+	CHECK(queue.size() == 3);
+}
+
+//a drained burst hands its chunks back, and the pool trims them to its watermarks
+TEST(chunkQueueReleasesBurstMemory)
+{
+	ChunkPoolPtr pool(new ChunkPool(2, 4));
+	{
+		ChunkQueue fifo(pool, 1);
+		int n = 10 * MsgChunk::CAPACITY;
+		for (int i = 0; i < n; ++i)
+			fifo.push_back(MsgPtr<int>(new Msg<int>(i)));
+		bool ordered = true;
+		for (int i = 0; i < n; ++i)
+		{
+			ordered = ordered && intOf(fifo.front()) == i;
+			fifo.pop_front();
+		}
+		CHECK(ordered);
+		CHECK(fifo.empty());
+		CHECK(pool->cached() <= 4);
+	}
+	CHECK(pool->cached() <= 4);
+	pool->trim();
+	CHECK(pool->cached() == 0);
+}
+
+//an id whose message was dropped by the overflow policy can be retried
+template <typename Q>
+static void checkDedupAfterDrop()
+{
+	Q queue;
+	MsgPtr<int> probe(new Msg<int>(0));
+	queue.setBudget(probe->byteSize(), OverflowPolicy::DropNewest);
+	queue.setDedup(DedupFilterPtr(new DedupFilter(60000000)));
+	MsgPtr<int> first(new Msg<int>(1));
+	first->setid(1);
+	MsgPtr<int> second(new Msg<int>(2));
+	second->setid(2);
+	CHECK(queue.enqueue(first));
+	CHECK(!queue.enqueue(second));
+	CHECK(queue.duplicates() == 0);
+	CHECK(queue.dequeue());
+	MsgPtr<int> retry(new Msg<int>(2));
+	retry->setid(2);
+	CHECK(queue.enqueue(retry));
+	MsgPtr<int> again(new Msg<int>(1));
+	again->setid(1);
+	CHECK(!queue.enqueue(again));
+	CHECK(queue.duplicates() == 1);
+}
+
+TEST(dedupForgetsDroppedIds)
+{
+	checkDedupAfterDrop<MsgQueue>();
+	checkDedupAfterDrop<RelaxedMsgQueue>();
+	checkDedupAfterDrop<EdfMsgQueue>();
+}
+
+//a late subscriber is replayed the last depth messages, oldest first, then gets live ones
+TEST(historyReplaysToLateSubscriber)
+{
+	ThreadSafeMsgQueuePtr broker = ThreadSafeMsgQueue::getInstance();
+	broker->setHistoryDepth("history", 3);
+	for (int i = 0; i < 5; ++i)
+		broker->publish<int>("history", MsgPtr<int>(new Msg<int>(i)));
+	drain(broker);
+	std::vector<int> got;
+	broker->subscribe<int>("history", [&](const MsgPtr<int> msg) { got.push_back(msg->getContent()); });
+	CHECK(got.size() == 3 && got[0] == 2 && got[1] == 3 && got[2] == 4);
+	broker->publish<int>("history", MsgPtr<int>(new Msg<int>(5)));
+	drain(broker);
+	CHECK(got.size() == 4 && got.back() == 5);
+}
+
+//blocks recorded out of timestamp order are still found, and a damaged index is refused
+TEST(columnarScanFindsUnorderedSamples)
+{
+	std::string path = SpillStore::defaultDir() + "/unit_test_columnar.col";
+	std::vector<std::pair<int64_t, int> > samples;
+	{
+		ColumnarWriter<int> writer(path, 8);
+		CHECK(writer.isOpen());
+		for (int i = 0; i < 64; ++i)
+		{
+			//interleaved like a priority-ordered dispatch: late and early timestamps alternate
+			int64_t t = i % 2 ? 1000 - i : 2000 + i;
+			samples.push_back(std::make_pair(t, i));
+			writer.append(t, i);
+		}
+	}
+	ColumnarReader<int> reader(path);
+	CHECK(reader.isOpen());
+	CHECK(reader.blocks() == 8);
+	int64_t ranges[][2] = {{900, 1000}, {2000, 2010}, {0, 3000}, {1000, 2000}, {2060, 2070}};
+	for (size_t r = 0; r < sizeof(ranges) / sizeof(ranges[0]); ++r)
+	{
+		size_t expected = 0;
+		for (size_t i = 0; i < samples.size(); ++i)
+			expected += samples[i].first >= ranges[r][0] && samples[i].first < ranges[r][1];
+		size_t found = 0;
+		reader.scan(ranges[r][0], ranges[r][1], [&](int64_t t, int v) {
+			found += samples[v].first == t;
+		});
+		CHECK(found == expected);
+	}
+
+	//point the first index entry past the end of the file
+	FILE *file = fopen(path.c_str(), "r+b");
+	columnar::Trailer trailer;
+	fseek(file, -(long)sizeof(trailer), SEEK_END);
+	CHECK(fread(&trailer, sizeof(trailer), 1, file) == 1);
+	columnar::IndexEntry entry;
+	fseek(file, trailer.index_offset, SEEK_SET);
+	CHECK(fread(&entry, sizeof(entry), 1, file) == 1);
+	entry.offset = 1 << 30;
+	fseek(file, trailer.index_offset, SEEK_SET);
+	fwrite(&entry, sizeof(entry), 1, file);
+	fclose(file);
+	CHECK(!ColumnarReader<int>(path).isOpen());
+	remove(path.c_str());
+}
+
+//a publish to another broker from inside a callback reaches that broker
+TEST(callbackPublishesReachTheirBroker)
+{
+	ThreadSafeMsgQueuePtr a = ThreadSafeMsgQueue::create();
+	ThreadSafeMsgQueuePtr b = ThreadSafeMsgQueue::create();
+	int received = 0;
+	a->subscribe<int>("in", [&](const MsgPtr<int> msg) { b->publish<int>("out", MsgPtr<int>(new Msg<int>(msg->getContent()))); });
+	b->subscribe<int>("out", [&](const MsgPtr<int>) { ++received; });
+	a->publish<int>("in", MsgPtr<int>(new Msg<int>(1)));
+	drain(a);
+	CHECK(a->size() == 0);
+	CHECK(b->size() == 1);
+	drain(b);
+	CHECK(received == 1);
+}
+
+//two dispatchers whose callbacks subscribe to each other's topics (with history) both finish
+TEST(crossSubscribeFromCallbacksDoesNotDeadlock)
+{
+	ThreadSafeMsgQueuePtr broker = ThreadSafeMsgQueue::create();
+	broker->setHistoryDepth("x", 4);
+	broker->setHistoryDepth("y", 4);
+	std::atomic<int> inside(0);
+	std::atomic<int> replayed(0);
+	auto rendezvous = [&] {
+		++inside;
+		auto give_up = std::chrono::steady_clock::now() + std::chrono::seconds(2);
+		while (inside < 2 && std::chrono::steady_clock::now() < give_up)
+			std::this_thread::yield();
+	};
+	auto count = [&](const MsgPtr<int>) { ++replayed; };
+	broker->subscribe<int>("x", [&](const MsgPtr<int>) {
+		rendezvous();
+		broker->subscribe<int>("y", count);
+	});
+	broker->subscribe<int>("y", [&](const MsgPtr<int>) {
+		rendezvous();
+		broker->subscribe<int>("x", count);
+	});
+	broker->publish<int>("x", MsgPtr<int>(new Msg<int>(1)));
+	std::thread first([&] { broker->runOnce(); });
+	while (inside < 1)
+		std::this_thread::yield();
+	broker->publish<int>("y", MsgPtr<int>(new Msg<int>(2)));
+	std::thread second([&] { broker->runOnce(); });
+	first.join();
+	second.join();
+	CHECK(inside == 2);
+	//each new subscriber got the other topic's history
+	CHECK(replayed == 2);
+}
+
+//values published on the real-time ring arrive in order, and a full ring refuses instead of waiting
+TEST(rtPublisherDeliversInOrder)
+{
+	ThreadSafeMsgQueuePtr broker = ThreadSafeMsgQueue::create();
+	RtPublisherPtr<int> publisher = broker->advertiseRt<int>("rt", 8);
+	std::vector<int> got;
+	broker->subscribe<int>("rt", [&](const MsgPtr<int> msg) { got.push_back(msg->getContent()); });
+	for (int i = 0; i < 8; ++i)
+		CHECK(publisher->tryPublish(i));
+	CHECK(!publisher->tryPublish(8));
+	CHECK(publisher->failed() == 1);
+
+	const int total = 20000;
+	std::thread producer([&] {
+		for (int i = 8; i < total; ++i)
+		{
+			while (!publisher->tryPublish(i))
+				std::this_thread::yield();
+		}
+	});
+	while (got.size() < (size_t)total)
+		broker->runOnce();
+	producer.join();
+	bool ordered = true;
+	for (int i = 0; i < total; ++i)
+		ordered = ordered && got[i] == i;
+	CHECK(ordered);
+}
+
+//once warmed up, dispatching real-time publishes does not allocate
+TEST(warmDispatchDoesNotAllocate)
+{
+	CHECK(realtime::hooked());
+	ThreadSafeMsgQueuePtr broker = ThreadSafeMsgQueue::create();
+	broker->reserve("ctl", 1024);
+	RtPublisherPtr<int> publisher = broker->advertiseRt<int>("ctl", 64);
+	int64_t sum = 0;
+	broker->subscribe<int>("ctl", [&](const MsgPtr<int> msg) { sum += msg->getContent(); });
+	for (int round = 0; round < 200; ++round)
+	{
+		publisher->tryPublish(round);
+		broker->runOnce();
+	}
+	drain(broker);
+	uint64_t before = realtime::violations();
+	int64_t expected = sum;
+	{
+		realtime::NoAllocScope no_alloc;
+		for (int round = 0; round < 1000; ++round)
+		{
+			publisher->tryPublish(round);
+			expected += round;
+			broker->runOnce();
+		}
+	}
+	drain(broker);
+	CHECK(realtime::violations() == before);
+	CHECK(sum == expected);
+}
+
+//huge-page reservations are 2 MiB aligned, and queues reserved on them work as usual
+TEST(hugePageReservations)
+{
+	hugepage::Backing backing;
+	void *p = hugepage::map(1, &backing);
+	CHECK(!p || ((uintptr_t)p & (hugepage::roundUp(1) - 1)) == 0);
+	if (p)
+		hugepage::unmap(p, 1);
+
+	ChunkPoolPtr pool(new ChunkPool());
+	pool->reserve(4, true);
+	CHECK(pool->arenaAvailable() >= 4 || pool->cached() >= 4);
+
+	MsgQueue fifo;
+	fifo.reserve(1000, true);
+	RelaxedMsgQueue relaxed(2);
+	relaxed.reserve(1000, true);
+	for (int i = 0; i < 1000; ++i)
+	{
+		fifo.enqueue(MsgPtr<int>(new Msg<int>(i)));
+		relaxed.enqueue(MsgPtr<int>(new Msg<int>(i)));
+	}
+	CHECK(fifo.size() == 1000 && relaxed.size() == 1000);
+	CHECK(intOf(fifo.dequeue()) == 0);
+
+	RtPublisher<int> publisher(16, 0, true);
+	CHECK(publisher.tryPublish(7));
+	BaseMsgPtr msg = publisher.pop();
+	CHECK(msg && intOf(msg) == 7);
+}
+
+//a strict broker refuses undeclared topics everywhere, and redeclaring keeps retained history
+TEST(strictBrokerAndRedeclaredHistory)
+{
+	ThreadSafeMsgQueuePtr broker = ThreadSafeMsgQueue::create();
+	BrokerConfig config;
+	config.strict = true;
+	TopicConfig declared;
+	declared.name = "declared";
+	declared.history_depth = 2;
+	config.topics.push_back(declared);
+	CHECK(broker->configure(config));
+
+	CHECK(!broker->publish<int>("undeclared", MsgPtr<int>(new Msg<int>(1))));
+	CHECK(!broker->subscribe<int>("undeclared", [](const MsgPtr<int>) {}));
+	CHECK(!broker->subscribeOwned<int>("undeclared", [](int &&) {}));
+	CHECK(!broker->setRateLimit("undeclared", 10));
+	CHECK(!broker->setAqm("undeclared", 1000));
+	CHECK(!broker->setDedup("undeclared", 1000));
+	CHECK(!broker->reserve("undeclared", 16));
+	CHECK(!broker->setTopicBudget("undeclared", 1024));
+	CHECK(!broker->setLatencyTarget("undeclared", 1000));
+	CHECK(!broker->setHistoryDepth("undeclared", 4));
+	CHECK(!broker->advertiseRt<int>("undeclared", 8));
+	CHECK(!broker->setQueue("undeclared", ThreadSafeMsgQueue::QueuePtr(new MsgQueue())));
+
+	CHECK(broker->publish<int>("declared", MsgPtr<int>(new Msg<int>(1))));
+	CHECK(broker->publish<int>("declared", MsgPtr<int>(new Msg<int>(2))));
+	drain(broker);
+	CHECK(broker->configure(config));
+	int replayed = 0;
+	CHECK(broker->subscribe<int>("declared", [&](const MsgPtr<int>) { ++replayed; }));
+	CHECK(replayed == 2);
+
+	config.topics[0].history_depth = 3;
+	CHECK(broker->configure(config));
+	replayed = 0;
+	broker->subscribe<int>("declared", [&](const MsgPtr<int>) { ++replayed; });
+	CHECK(replayed == 0);
+}
+
+static SubscribeOptions withPriority(int priority)
+{
+	SubscribeOptions options;
+	options.priority = priority;
+	return options;
+}
+
+//higher priority callbacks run first; fast-lane callbacks of every topic run before the rest
+TEST(subscribersRunByPriority)
+{
+	ThreadSafeMsgQueuePtr broker = ThreadSafeMsgQueue::create();
+	std::vector<std::string> order;
+	broker->subscribe<int>("a", [&](const MsgPtr<int>) { order.push_back("a0"); });
+	broker->subscribe<int>("a", [&](const MsgPtr<int>) { order.push_back("a5"); }, withPriority(5));
+	broker->subscribe<int>("a", [&](const MsgPtr<int>) { order.push_back("a0b"); });
+	broker->subscribe<int>("b", [&](const MsgPtr<int>) { order.push_back("b0"); });
+	broker->subscribe<int>("b", [&](const MsgPtr<int>) { order.push_back("b9"); }, withPriority(9));
+	broker->publish<int>("a", MsgPtr<int>(new Msg<int>(1)));
+	broker->publish<int>("b", MsgPtr<int>(new Msg<int>(1)));
+	broker->runOnce();
+	const char *expected[] = {"a5", "b9", "a0", "a0b", "b0"};
+	CHECK(order.size() == 5);
+	for (size_t i = 0; i < order.size() && i < 5; ++i)
+		CHECK(order[i] == expected[i]);
+}
+
+//topics cross a Unix socket in order; a frame larger than the receiver's window, queued before
+//the window was known, is dropped instead of stalling the sender
+TEST(bridgeRoundTripOverUnixSocket)
+{
+	std::string path = SpillStore::defaultDir() + "/unit_test_bridge.sock";
+	int listener = bridge::listenUnix(path);
+	CHECK(listener >= 0);
+	int client = bridge::connectUnix(path);
+	int server = accept(listener, nullptr, nullptr);
+	close(listener);
+	unlink(path.c_str());
+	CHECK(client >= 0 && server >= 0);
+
+	ThreadSafeMsgQueuePtr local = ThreadSafeMsgQueue::create();
+	ThreadSafeMsgQueuePtr remote = ThreadSafeMsgQueue::create();
+	BridgeSender sender(local, client);
+	BridgeReceiver receiver(remote, server, 8, 512);
+	sender.forward<std::string>("bridged");
+	receiver.accept<std::string>("bridged");
+	std::vector<std::string> got;
+	remote->subscribe<std::string>("bridged", [&](const MsgPtr<std::string> msg) { got.push_back(msg->getContent()); });
+
+	local->publish<std::string>("bridged", MsgPtr<std::string>(new Msg<std::string>(std::string(2000, 'x'))));
+	const int total = 100;
+	for (int i = 0; i < total; ++i)
+		local->publish<std::string>("bridged", MsgPtr<std::string>(new Msg<std::string>("m" + std::to_string(i))));
+	drain(local);
+	CHECK(sender.pending() == total + 1);
+	receiver.start();
+	sender.start();
+
+	auto give_up = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+	while (got.size() < (size_t)total && std::chrono::steady_clock::now() < give_up)
+	{
+		if (!remote->runOnce())
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	CHECK(got.size() == (size_t)total);
+	bool ordered = true;
+	for (size_t i = 0; i < got.size(); ++i)
+		ordered = ordered && got[i] == "m" + std::to_string(i);
+	CHECK(ordered);
+	CHECK(sender.dropped() == 1);
+	CHECK(sender.sent() == (uint64_t)total);
+	CHECK(receiver.received() == (uint64_t)total);
+	sender.stop();
+	receiver.stop();
+}
+
+//a callback throwing in the middle of a batch still lets the rest of the round be delivered
+TEST(throwingCallbackKeepsTheBatch)
+{
+	ThreadSafeMsgQueuePtr broker = ThreadSafeMsgQueue::create();
+	broker->setLatencyTarget("batched", 1000000, 64);
+	std::vector<int> got;
+	std::vector<int> other;
+	broker->subscribe<int>("batched", [&](const MsgPtr<int> msg) {
+		got.push_back(msg->getContent());
+		if (msg->getContent() == 2)
+			throw std::runtime_error("callback failed");
+	});
+	broker->subscribe<int>("other", [&](const MsgPtr<int> msg) { other.push_back(msg->getContent()); });
+	for (int round = 0; round < 4; ++round)
+	{
+		for (int i = 0; i < 8; ++i)
+			broker->publish<int>("batched", MsgPtr<int>(new Msg<int>(i + 1)));
+		broker->publish<int>("other", MsgPtr<int>(new Msg<int>(round)));
+		int thrown = 0;
+		while (true)
+		{
+			try {
+				if (!broker->runOnce())
+					break;
+			}
+			catch (const std::runtime_error &) {
+				++thrown;
+			}
+		}
+		CHECK(thrown == 1);
+	}
+	CHECK(got.size() == 32);
+	CHECK(other.size() == 4);
+	CHECK(broker->stats("batched").dispatched == 32);
+	CHECK(broker->stats("batched").batch_size > 1);
+	CHECK(broker->size() == 0);
+}
+
+//a standing queue drained slower than it fills: CoDel drops (or marks) part of it, never the last message
+template <typename Q>
+static void checkAqmUnderOverload(bool mark)
+{
+	Q queue;
+	queue.setAqm(1000, 5000, mark);
+	const int total = 60;
+	for (int i = 0; i < total; ++i)
+		queue.enqueue(MsgPtr<int>(new Msg<int>(i)));
+	int delivered = 0;
+	int marked = 0;
+	while (BaseMsgPtr msg = queue.dequeue())
+	{
+		++delivered;
+		marked += msg->getmarked() ? 1 : 0;
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	if (mark) {
+		CHECK(delivered == total);
+		CHECK(marked > 0 && (uint64_t)marked == queue.marked());
+		CHECK(queue.dropped() == 0);
+	}
+	else {
+		CHECK(delivered > 0 && delivered < total);
+		CHECK((uint64_t)(delivered + queue.dropped()) == (uint64_t)total);
+		CHECK(queue.marked() == 0);
+	}
+	CHECK(queue.size() == 0);
+}
+
+TEST(aqmDropsUnderOverload)
+{
+	checkAqmUnderOverload<MsgQueue>(false);
+	checkAqmUnderOverload<MsgQueue>(true);
+	checkAqmUnderOverload<RelaxedMsgQueue>(false);
+	checkAqmUnderOverload<RelaxedMsgQueue>(true);
+
+	//a burst drained right away stays under target and passes untouched
+	MsgQueue queue;
+	queue.setAqm(50000, 100000);
+	for (int i = 0; i < 100; ++i)
+		queue.enqueue(MsgPtr<int>(new Msg<int>(i)));
+	int delivered = 0;
+	while (queue.dequeue())
+		++delivered;
+	CHECK(delivered == 100);
+	CHECK(queue.dropped() == 0);
+}
+
+//a message refused by one rate limit takes no token from the other, and delayed messages are
+//charged to the topic's budget and capped
+TEST(rateLimitsTakeBothTokensOrNeither)
+{
+	ThreadSafeMsgQueuePtr broker = ThreadSafeMsgQueue::create();
+	broker->setPublisherRateLimit("p", 1, 5);
+	broker->setRateLimit("limited", 1, 1);
+	broker->setPublisherIdentity("p");
+	int accepted = 0;
+	for (int i = 0; i < 5; ++i)
+		accepted += broker->publish<int>("limited", MsgPtr<int>(new Msg<int>(i))) ? 1 : 0;
+	CHECK(accepted == 1);
+	//the four refused publishes left the publisher's quota alone
+	accepted = 0;
+	for (int i = 0; i < 5; ++i)
+		accepted += broker->publish<int>("free", MsgPtr<int>(new Msg<int>(i))) ? 1 : 0;
+	CHECK(accepted == 4);
+	broker->setPublisherIdentity("");
+
+	broker->setRateLimit("delayed", 1, 1, RateLimitPolicy::Delay);
+	broker->setDelayLimit(3);
+	accepted = 0;
+	for (int i = 0; i < 10; ++i)
+		accepted += broker->publish<int>("delayed", MsgPtr<int>(new Msg<int>(i))) ? 1 : 0;
+	CHECK(accepted == 4);
+	CHECK(broker->stats("delayed").delayed == 3);
+
+	MsgPtr<int> probe(new Msg<int>(0));
+	broker->setDelayLimit(100);
+	broker->setTopicBudget("budgeted", 2 * probe->byteSize(), OverflowPolicy::DropNewest);
+	broker->setRateLimit("budgeted", 1, 1, RateLimitPolicy::Delay);
+	accepted = 0;
+	for (int i = 0; i < 10; ++i)
+		accepted += broker->publish<int>("budgeted", MsgPtr<int>(new Msg<int>(i))) ? 1 : 0;
+	CHECK(accepted == 2);
+	CHECK(broker->stats("budgeted").delayed == 1);
+	CHECK(broker->usedBytes("budgeted") == 2 * probe->byteSize());
+}
+
+//downsampled subscribers get every Nth message or at most max_rate per second, while the
+//others on the topic still get everything
+TEST(downsampledSubscriptions)
+{
+	ThreadSafeMsgQueuePtr broker = ThreadSafeMsgQueue::create();
+	std::vector<int> all;
+	std::vector<int> nth;
+	SubscribeOptions every_third;
+	every_third.every_nth = 3;
+	broker->subscribe<int>("sampled", [&](const MsgPtr<int> msg) { all.push_back(msg->getContent()); });
+	broker->subscribe<int>("sampled", [&](const MsgPtr<int> msg) { nth.push_back(msg->getContent()); }, every_third);
+	for (int i = 0; i < 10; ++i)
+		broker->publish<int>("sampled", MsgPtr<int>(new Msg<int>(i)));
+	drain(broker);
+	CHECK(all.size() == 10);
+	CHECK(nth == std::vector<int>({0, 3, 6, 9}));
+
+	int slow = 0;
+	int fast = 0;
+	SubscribeOptions ten_hz;
+	ten_hz.max_rate = 10;
+	broker->subscribe<int>("throttled", [&](const MsgPtr<int>) { ++slow; }, ten_hz);
+	broker->subscribe<int>("throttled", [&](const MsgPtr<int>) { ++fast; });
+	auto end = std::chrono::steady_clock::now() + std::chrono::milliseconds(300);
+	while (std::chrono::steady_clock::now() < end)
+	{
+		broker->publish<int>("throttled", MsgPtr<int>(new Msg<int>(0)));
+		drain(broker);
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+	CHECK(fast > 50);
+	CHECK(slow >= 2 && slow <= 5);
+}
+
+//DropOldest on an EDF queue evicts the latest deadline, keeping the urgent work
+TEST(edfDropOldestKeepsUrgentWork)
+{
+	EdfMsgQueue queue;
+	MsgPtr<int> probe(new Msg<int>(0));
+	queue.setBudget(3 * probe->byteSize(), OverflowPolicy::DropOldest);
+	int64_t base = queue.now() + 60000000;
+	int deadlines[] = {5, 1, 9, 3};
+	for (int i = 0; i < 4; ++i)
+	{
+		MsgPtr<int> msg(new Msg<int>(deadlines[i]));
+		msg->setdeadline(base + deadlines[i]);
+		CHECK(queue.enqueue(msg));
+	}
+	CHECK(queue.dropped() == 1);
+	std::vector<int> order;
+	while (BaseMsgPtr msg = queue.dequeue())
+		order.push_back(intOf(msg));
+	CHECK(order == std::vector<int>({1, 3, 5}));
+	CHECK(queue.usedBytes() == 0);
+}
+
+//a replace racing a spill either reaches the copy on disk or reports failure
+TEST(replaceRacingSpill)
+{
+	MsgQueue queue;
+	MsgPtr<int> probe(new Msg<int>(0));
+	queue.setBudget(probe->byteSize(), OverflowPolicy::Spill);
+	const int total = 2000;
+	std::vector<MsgPtr<int> > msgs;
+	for (int i = 0; i < total; ++i)
+	{
+		msgs.push_back(MsgPtr<int>(new Msg<int>(0)));
+		msgs.back()->track();
+	}
+	std::vector<char> replaced(total, 0);
+	std::atomic<int> published(0);
+	std::thread replacer([&] {
+		for (int i = 0; i < total; ++i)
+		{
+			while (published.load() < i)
+				std::this_thread::yield();
+			MsgHandle<int> handle(msgs[i]);
+			replaced[i] = handle.replace(1) ? 1 : 0;
+		}
+	});
+	for (int i = 0; i < total; ++i)
+	{
+		published.store(i);
+		queue.enqueue(msgs[i]);
+	}
+	published.store(total);
+	replacer.join();
+	CHECK(queue.spilledBytes() > 0);
+	int mismatched = 0;
+	for (int i = 0; i < total; ++i)
+	{
+		BaseMsgPtr msg = queue.dequeue();
+		CHECK(msg);
+		if (!msg)
+			break;
+		mismatched += intOf(msg) != replaced[i] ? 1 : 0;
+	}
+	CHECK(mismatched == 0);
+	CHECK(!queue.dequeue());
+
+	//once spilled, a message can no longer be cancelled or replaced
+	MsgPtr<int> spilled(new Msg<int>(7));
+	spilled->track();
+	CHECK(queue.enqueue(MsgPtr<int>(new Msg<int>(6))));
+	CHECK(queue.enqueue(spilled));
+	MsgHandle<int> handle(spilled);
+	CHECK(!handle.pending());
+	CHECK(!handle.cancel());
+	CHECK(!handle.replace(8));
+	CHECK(intOf(queue.dequeue()) == 6);
+	CHECK(intOf(queue.dequeue()) == 7);
+}
+
+//a message shared with another topic or still held by its publisher is copied, not moved, into
+//an owned subscription
+TEST(ownedSubscriptionCopiesSharedMessages)
+{
+	ThreadSafeMsgQueuePtr broker = ThreadSafeMsgQueue::create();
+	std::vector<std::string> owned;
+	std::vector<std::string> plain;
+	broker->subscribeOwned<std::string>("owned", [&](std::string &&s) { owned.push_back(std::move(s)); });
+	broker->subscribe<std::string>("plain", [&](const MsgPtr<std::string> msg) { plain.push_back(msg->getContent()); });
+
+	MsgPtr<std::string> shared(new Msg<std::string>("shared payload"));
+	CHECK(broker->publish<std::string>("owned", shared));
+	CHECK(broker->publish<std::string>("plain", shared));
+	drain(broker);
+	CHECK(owned == std::vector<std::string>({"shared payload"}));
+	CHECK(plain == std::vector<std::string>({"shared payload"}));
+	CHECK(shared->getContent() == "shared payload");
+
+	//nobody else holds this one, so it is moved
+	broker->publish<std::string>("owned", MsgPtr<std::string>(new Msg<std::string>("moved payload")));
+	drain(broker);
+	CHECK(owned.size() == 2 && owned.back() == "moved payload");
+
+	//a move-only payload still held elsewhere cannot be copied, so it is not delivered
+	int buffers = 0;
+	broker->subscribeOwned<std::unique_ptr<int> >("buffers", [&](std::unique_ptr<int> &&p) { buffers += p ? *p : 0; });
+	MsgPtr<std::unique_ptr<int> > kept(new Msg<std::unique_ptr<int> >(std::unique_ptr<int>(new int(1))));
+	broker->publish<std::unique_ptr<int> >("buffers", kept);
+	drain(broker);
+	CHECK(buffers == 0);
+	CHECK(kept->getContentRef() && *kept->getContentRef() == 1);
+	broker->publish<std::unique_ptr<int> >("buffers", MsgPtr<std::unique_ptr<int> >(new Msg<std::unique_ptr<int> >(std::unique_ptr<int>(new int(2)))));
+	drain(broker);
+	CHECK(buffers == 2);
+}
+
+//upstream of a test arena, counting the bytes it holds
+struct CountingResource : public MemoryResource
+{
+	CountingResource() : held(0) {}
+	virtual void *allocate(size_t bytes)
+	{
+		held += bytes;
+		return ::operator new(bytes);
+	}
+	virtual void deallocate(void *p, size_t bytes)
+	{
+		held -= bytes;
+		::operator delete(p);
+	}
+	std::atomic<size_t> held;
+};
+
+//a request-scoped topic's arena is swapped for a fresh one once the topic is idle, and the old
+//one goes back upstream when its last message does
+TEST(monotonicArenaResets)
+{
+	ThreadSafeMsgQueuePtr broker = ThreadSafeMsgQueue::create();
+	std::shared_ptr<CountingResource> upstream(new CountingResource());
+	CHECK(broker->setMemoryResource("request", MemoryResourcePtr(new MonotonicResource(4096, upstream))));
+	int received = 0;
+	broker->subscribe<std::string>("request", [&](const MsgPtr<std::string>) { ++received; });
+	for (int i = 0; i < 100; ++i)
+		broker->publish<std::string>("request", broker->make<std::string>("request", std::string("payload")));
+	CHECK(!broker->resetArena("request"));
+	MsgPtr<std::string> kept = broker->make<std::string>("request", std::string("kept"));
+	drain(broker);
+	CHECK(received == 100);
+	size_t before = upstream->held;
+	CHECK(before > 0);
+	CHECK(broker->resetArena("request"));
+	//kept still lives in the old arena
+	CHECK(upstream->held >= before);
+	kept.reset();
+	CHECK(upstream->held < before);
+	broker->publish<std::string>("request", broker->make<std::string>("request", std::string("again")));
+	drain(broker);
+	CHECK(received == 101);
+
+	//no arena to reset, and none shared by the broker
+	CHECK(!broker->resetArena("plain"));
+	CHECK(!broker->resetArena());
+	//a retained message pins the arena
+	broker->setHistoryDepth("request", 4);
+	broker->publish<std::string>("request", broker->make<std::string>("request", std::string("retained")));
+	drain(broker);
+	CHECK(!broker->resetArena("request"));
+
+	//the arena every topic shares under BrokerConfig::allocator
+	ThreadSafeMsgQueuePtr shared = ThreadSafeMsgQueue::create();
+	BrokerConfig config;
+	config.allocator = AllocatorKind::Monotonic;
+	CHECK(shared->configure(config));
+	shared->subscribe<int>("a", [&](const MsgPtr<int>) { ++received; });
+	shared->publish<int>("a", shared->make<int>("a", 1));
+	CHECK(!shared->resetArena());
+	drain(shared);
+	CHECK(shared->resetArena());
+	CHECK(shared->resetArena("a"));
+}
+
+//the single-threaded broker round-trips messages, and a full Block budget refuses instead of
+//waiting for a dispatcher that can never run
+TEST(singleThreadedBrokerRoundTrip)
+{
+	std::shared_ptr<SingleThreadedBroker> broker = SingleThreadedBroker::create();
+	std::vector<int> got;
+	CHECK(broker->subscribe<int>("loop", [&](const MsgPtr<int> msg) {
+		got.push_back(msg->getContent());
+		if (msg->getContent() < 3)
+			broker->publish<int>("loop", MsgPtr<int>(new Msg<int>(msg->getContent() + 10)));
+	}));
+	for (int i = 0; i < 5; ++i)
+		CHECK(broker->publish<int>("loop", MsgPtr<int>(new Msg<int>(i))));
+	while (broker->runOnce())
+		;
+	CHECK(got == std::vector<int>({0, 1, 2, 3, 4, 10, 11, 12}));
+
+	MsgPtr<int> probe(new Msg<int>(0));
+	CHECK(broker->setTopicBudget("bounded", 2 * probe->byteSize(), OverflowPolicy::Block));
+	int accepted = 0;
+	for (int i = 0; i < 5; ++i)
+		accepted += broker->publish<int>("bounded", MsgPtr<int>(new Msg<int>(i))) ? 1 : 0;
+	CHECK(accepted == 2);
+	CHECK(broker->stats("bounded").dropped == 3);
+	CHECK(broker->setTopicBudget("spilled", 2 * probe->byteSize(), OverflowPolicy::Spill));
+	for (int i = 0; i < 5; ++i)
+		CHECK(broker->publish<int>("spilled", MsgPtr<int>(new Msg<int>(i))));
+	int drained = 0;
+	broker->subscribe<int>("spilled", [&](const MsgPtr<int> msg) { drained += msg->getContent() == drained ? 1 : 0; });
+	while (broker->runOnce())
+		;
+	CHECK(drained == 5);
+
+	SingleThreadedMsgQueue queue;
+	queue.setBudget(probe->byteSize(), OverflowPolicy::Block);
+	CHECK(queue.enqueue(MsgPtr<int>(new Msg<int>(1))));
+	CHECK(!queue.enqueue(MsgPtr<int>(new Msg<int>(2))));
+	CHECK(intOf(queue.dequeue_block()) == 1);
+	CHECK(!queue.dequeue_block());
+}
+
+//a callback publishing into a full Block topic drops the overflow instead of parking the dispatcher
+TEST(callbackPublishIntoFullBlockTopic)
+{
+	ThreadSafeMsgQueuePtr broker = ThreadSafeMsgQueue::create();
+	MsgPtr<int> probe(new Msg<int>(0));
+	CHECK(broker->setTopicBudget("full", 2 * probe->byteSize(), OverflowPolicy::Block));
+	int got = 0;
+	broker->subscribe<int>("trigger", [&](const MsgPtr<int>) {
+		for (int i = 0; i < 3; ++i)
+			broker->publish<int>("full", MsgPtr<int>(new Msg<int>(i)));
+	});
+	broker->subscribe<int>("full", [&](const MsgPtr<int>) { ++got; });
+	broker->publish<int>("trigger", MsgPtr<int>(new Msg<int>(0)));
+	std::atomic<bool> done(false);
+	std::thread dispatcher([&] {
+		drain(broker);
+		done = true;
+	});
+	auto give_up = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+	while (!done && std::chrono::steady_clock::now() < give_up)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	CHECK(done);
+	//unstick a parked dispatcher so the test can end
+	if (!done)
+		broker->setTopicBudget("full", 0);
+	dispatcher.join();
+	CHECK(got == 2);
+	CHECK(broker->stats("full").dropped == 1);
+}
+
+//time for threads runOnce() callers to deliver per_topic messages on each of 8 topics whose
+//callbacks take a millisecond
+static double dispatchMillis(size_t threads, int per_topic)
+{
+	ThreadSafeMsgQueuePtr broker = ThreadSafeMsgQueue::create();
+	broker->setDispatchers(threads);
+	const int topics = 8;
+	std::atomic<int> delivered(0);
+	for (int t = 0; t < topics; ++t)
+	{
+		std::string name = "parallel" + std::to_string(t);
+		broker->subscribe<int>(name, [&](const MsgPtr<int>) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			++delivered;
+		});
+		for (int i = 0; i < per_topic; ++i)
+			broker->publish<int>(name, MsgPtr<int>(new Msg<int>(i)));
+	}
+	auto begin = std::chrono::steady_clock::now();
+	std::vector<std::thread> dispatchers;
+	for (size_t i = 0; i < threads; ++i)
+		dispatchers.push_back(std::thread([&] {
+			while (delivered.load() < topics * per_topic)
+			{
+				if (!broker->runOnce())
+					std::this_thread::yield();
+			}
+		}));
+	for (size_t i = 0; i < dispatchers.size(); ++i)
+		dispatchers[i].join();
+	return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+}
+
+//concurrent runOnce() callers split the topics between them
+TEST(dispatchersSplitTopics)
+{
+	double one = dispatchMillis(1, 10);
+	double four = dispatchMillis(4, 10);
+	CHECK(four * 1.5 < one);
+}
+
+//DropOldest evicts the lowest priority, and of equal priorities the oldest
+template <typename Q>
+static std::vector<int> keptAfterDropOldest(const std::vector<int> &priorities)
+{
+	Q queue;
+	MsgPtr<int> probe(new Msg<int>(0));
+	queue.setBudget(3 * probe->byteSize(), OverflowPolicy::DropOldest);
+	for (size_t i = 0; i < priorities.size(); ++i)
+		queue.enqueue(MsgPtr<int>(new Msg<int>((int)i, priorities[i])));
+	std::vector<int> kept;
+	while (BaseMsgPtr msg = queue.dequeue())
+		kept.push_back(intOf(msg));
+	std::sort(kept.begin(), kept.end());
+	return kept;
+}
+
+TEST(dropOldestKeepsHighPriority)
+{
+	CHECK(keptAfterDropOldest<MsgQueue>({1, 9, 5, 2}) == std::vector<int>({1, 2, 3}));
+	CHECK(keptAfterDropOldest<MsgQueue>({2, 1, 1, 3}) == std::vector<int>({0, 2, 3}));
+	CHECK(keptAfterDropOldest<MsgQueue>({4, 4, 4, 4, 4}) == std::vector<int>({2, 3, 4}));
+	CHECK(keptAfterDropOldest<RelaxedMsgQueue>({1, 9, 5, 2}) == std::vector<int>({1, 2, 3}));
+	CHECK(keptAfterDropOldest<RelaxedMsgQueue>({2, 1, 1, 3}) == std::vector<int>({0, 2, 3}));
+
+	MsgQueue queue;
+	MsgPtr<int> probe(new Msg<int>(0));
+	queue.setBudget(3 * probe->byteSize(), OverflowPolicy::DropOldest);
+	int priorities[] = {1, 9, 5, 2};
+	for (int i = 0; i < 4; ++i)
+		queue.enqueue(MsgPtr<int>(new Msg<int>(priorities[i], priorities[i])));
+	std::vector<int> order;
+	while (BaseMsgPtr msg = queue.dequeue())
+		order.push_back(intOf(msg));
+	CHECK(order == std::vector<int>({9, 5, 2}));
+	CHECK(queue.dropped() == 1);
+	CHECK(queue.usedBytes() == 0);
+}
+
+//the pool grows under backlog, its workers dispatch different topics at the same time, and it
+//shrinks back to min_workers once idle
+TEST(dispatcherPoolScales)
+{
+	ThreadSafeMsgQueuePtr broker = ThreadSafeMsgQueue::create();
+	std::atomic<int> running(0);
+	std::atomic<int> most_running(0);
+	std::atomic<int> delivered(0);
+	const int topics = 8;
+	const int per_topic = 40;
+	for (int t = 0; t < topics; ++t)
+	{
+		std::string name = "scaled" + std::to_string(t);
+		broker->subscribe<int>(name, [&](const MsgPtr<int>) {
+			int now_running = ++running;
+			int seen = most_running.load();
+			while (now_running > seen && !most_running.compare_exchange_weak(seen, now_running))
+				;
+			std::this_thread::sleep_for(std::chrono::milliseconds(2));
+			--running;
+			++delivered;
+		});
+		for (int i = 0; i < per_topic; ++i)
+			broker->publish<int>(name, MsgPtr<int>(new Msg<int>(i)));
+	}
+	DispatcherPoolConfig config;
+	config.min_workers = 1;
+	config.max_workers = 4;
+	config.sample_interval = std::chrono::milliseconds(10);
+	config.idle_sleep = std::chrono::milliseconds(1);
+	config.scale_up_backlog = 4;
+	config.scale_up_samples = 1;
+	config.scale_down_samples = 3;
+	DispatcherPool pool(broker, config);
+	pool.start();
+	size_t largest = 0;
+	auto give_up = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+	while (delivered.load() < topics * per_topic && std::chrono::steady_clock::now() < give_up)
+	{
+		largest = (std::max)(largest, pool.size());
+		std::this_thread::sleep_for(std::chrono::milliseconds(2));
+	}
+	CHECK(delivered.load() == topics * per_topic);
+	CHECK(largest > 1);
+	CHECK(most_running.load() > 1);
+	while (pool.size() > config.min_workers && std::chrono::steady_clock::now() < give_up)
+		std::this_thread::sleep_for(std::chrono::milliseconds(5));
+	CHECK(pool.size() == config.min_workers);
+	pool.stop();
+}
+
+//delayed messages are released and delivered through the broker, keeping their budget charge
+//while a publisher competes for the same Block budget
+TEST(delayedMessagesAreDelivered)
+{
+	ThreadSafeMsgQueuePtr broker = ThreadSafeMsgQueue::create();
+	MsgPtr<int> probe(new Msg<int>(0));
+	CHECK(broker->setTopicBudget("paced", 3 * probe->byteSize(), OverflowPolicy::Block));
+	CHECK(broker->setRateLimit("paced", 500, 1, RateLimitPolicy::Delay));
+	std::atomic<int> got(0);
+	broker->subscribe<int>("paced", [&](const MsgPtr<int>) { ++got; });
+	for (int i = 0; i < 3; ++i)
+		CHECK(broker->publish<int>("paced", MsgPtr<int>(new Msg<int>(i))));
+	CHECK(broker->stats("paced").delayed == 2);
+	CHECK(broker->usedBytes("paced") == 3 * probe->byteSize());
+
+	std::atomic<int> accepted(3);
+	std::atomic<bool> published(false);
+	std::thread publisher([&] {
+		for (int i = 0; i < 200; ++i)
+		{
+			accepted += broker->publish<int>("paced", MsgPtr<int>(new Msg<int>(i))) ? 1 : 0;
+			std::this_thread::sleep_for(std::chrono::microseconds(500));
+		}
+		published = true;
+	});
+	auto give_up = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+	while ((!published || got.load() < accepted.load()) && std::chrono::steady_clock::now() < give_up)
+	{
+		if (!broker->runOnce())
+			std::this_thread::sleep_for(std::chrono::microseconds(200));
+	}
+	publisher.join();
+	CHECK(got.load() == accepted.load());
+	CHECK(accepted.load() > 3);
+	CHECK(broker->stats("paced").delayed == 0);
+	CHECK(broker->usedBytes("paced") == 0);
+}
+
+//draining a real-time ring into a full Block topic refuses the overflow instead of waiting
+TEST(rtDrainDoesNotWaitOnBudget)
+{
+	ThreadSafeMsgQueuePtr broker = ThreadSafeMsgQueue::create();
+	RtPublisherPtr<int> publisher = broker->advertiseRt<int>("rt_bounded", 8);
+	MsgPtr<int> probe(new Msg<int>(0));
+	CHECK(broker->setTopicBudget("rt_bounded", 2 * probe->byteSize(), OverflowPolicy::Block));
+	std::atomic<int> got(0);
+	broker->subscribe<int>("rt_bounded", [&](const MsgPtr<int>) { ++got; });
+	for (int i = 0; i < 5; ++i)
+		CHECK(publisher->tryPublish(i));
+	std::atomic<bool> done(false);
+	std::thread dispatcher([&] {
+		drain(broker);
+		done = true;
+	});
+	auto give_up = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+	while (!done && std::chrono::steady_clock::now() < give_up)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	CHECK(done);
+	//unstick a parked dispatcher so the test can end
+	if (!done)
+		broker->setTopicBudget("rt_bounded", 0);
+	dispatcher.join();
+	CHECK(got.load() == 2);
+	CHECK(publisher->refused() == 3);
+	CHECK(broker->stats("rt_bounded").dropped == 3);
+}
+
+//startBroker() prefaults reserved storage and real-time rings and locks memory when asked
+TEST(startBrokerEntersRealTime)
+{
+	BrokerConfig config;
+	config.prefault = true;
+	config.prefault_stack = 64 * 1024;
+	config.prefault_heap = 1024 * 1024;
+	config.max_workers = 1;
+	TopicConfig topic("rt_ready");
+	topic.capacity = 64;
+	config.topics.push_back(topic);
+	ThreadSafeMsgQueuePtr broker = ThreadSafeMsgQueue::create();
+	std::string error;
+	DispatcherPoolPtr pool = startBroker(broker, config, &error);
+	CHECK(pool != nullptr);
+	std::atomic<int> got(0);
+	broker->subscribe<int>("rt_ready", [&](const MsgPtr<int>) { ++got; });
+	RtPublisherPtr<int> publisher = broker->advertiseRt<int>("rt_ready", 16);
+	CHECK(publisher != nullptr);
+	for (int i = 0; i < 4; ++i)
+		CHECK(publisher->tryPublish(i));
+	auto give_up = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+	while (got < 4 && std::chrono::steady_clock::now() < give_up)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	CHECK(got.load() == 4);
+	pool->stop();
+
+	//mlockall may be refused by RLIMIT_MEMLOCK; startBroker() must then fail before starting workers
+	config.lock_memory = true;
+	ThreadSafeMsgQueuePtr locked = ThreadSafeMsgQueue::create();
+	pool = startBroker(locked, config, &error);
+	CHECK(pool != nullptr || error == "lock_memory: mlockall failed");
+	if (pool)
+	{
+		pool->stop();
+		munlockall();
+	}
+}
+
+static bool parseConfig(const std::string &text, BrokerConfig &config, std::string &error)
+{
+	std::istringstream in(text);
+	return BrokerConfigParser::parse(in, config, &error);
+}
+
+//broker and topic sections, size suffixes and comments
+TEST(parserReadsSections)
+{
+	BrokerConfig config;
+	std::string error;
+	CHECK(parseConfig("# broker wide\n"
+					  "[broker]\n"
+					  "memory_budget = 64M\n"
+					  "strict = true   # trailing comment\n"
+					  "min_workers = 2\n"
+					  "prefault_heap = 1G\n"
+					  "\n"
+					  "[topic pose]\n"
+					  "queue = relaxed\n"
+					  "capacity = 4K\n"
+					  "budget = 2k\n"
+					  "overflow = drop_oldest\n"
+					  "[topic alarms]\n"
+					  "queue = deadline\n"
+					  "drop_missed = yes\n"
+					  "rate_limit = 2.5\n",
+					  config, error));
+	CHECK(error.empty());
+	CHECK(config.memory_budget == 64u << 20);
+	CHECK(config.strict);
+	CHECK(config.min_workers == 2);
+	CHECK(config.prefault_heap == (size_t)1 << 30);
+	CHECK(config.topics.size() == 2);
+	CHECK(config.topics[0].name == "pose");
+	CHECK(config.topics[0].queue == QueueKind::Relaxed);
+	CHECK(config.topics[0].capacity == 4096);
+	CHECK(config.topics[0].budget == 2048);
+	CHECK(config.topics[0].overflow == OverflowPolicy::DropOldest);
+	CHECK(config.topics[1].name == "alarms");
+	CHECK(config.topics[1].queue == QueueKind::Deadline);
+	CHECK(config.topics[1].drop_missed);
+	CHECK(config.topics[1].rate_limit == 2.5);
+}
+
+//unknown keys, bad values and malformed lines fail with their line number
+TEST(parserReportsLineNumbers)
+{
+	struct Case
+	{
+		const char *text;
+		const char *error;
+	} cases[] = {
+		{"[broker]\nstrict = true\nbogus = 1\n", "line 3: bad value for 'bogus'"},
+		{"[topic a]\n\n# note\nnot_a_key = yes\n", "line 4: bad value for 'not_a_key'"},
+		{"[broker]\nmemory_budget = 12T\n", "line 2: bad value for 'memory_budget'"},
+		{"[topic a]\ncapacity = -1\n", "line 2: bad value for 'capacity'"},
+		{"[topic a]\noverflow = sometimes\n", "line 2: bad value for 'overflow'"},
+		{"[broker]\nstrict\n", "line 2: expected key = value"},
+		{"[broker\n", "line 1: unterminated section"},
+		{"[broker]\n[queues]\n", "line 2: unknown section 'queues'"},
+		{"strict = true\n", "line 1: key outside a section"},
+	};
+	for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i)
+	{
+		BrokerConfig config;
+		std::string error;
+		CHECK(!parseConfig(cases[i].text, config, error));
+		CHECK(error == cases[i].error);
+	}
+}
+
+//startBroker() creates the parsed topics with their settings before the first publish
+TEST(startBrokerAppliesParsedTopics)
+{
+	BrokerConfig config;
+	std::string error;
+	CHECK(parseConfig("[broker]\n"
+					  "strict = true\n"
+					  "min_workers = 1\n"
+					  "max_workers = 1\n"
+					  "[topic tight]\n"
+					  "budget = 1\n"
+					  "overflow = drop_newest\n"
+					  "[topic batched]\n"
+					  "latency_target_us = 500\n",
+					  config, error));
+	ThreadSafeMsgQueuePtr broker = ThreadSafeMsgQueue::create();
+	DispatcherPoolPtr pool = startBroker(broker, config, &error);
+	CHECK(pool != nullptr);
+	CHECK(pool->size() == 1);
+	CHECK(broker->stats("batched").latency_target_us == 500);
+	//strict: only declared topics accept publishes
+	CHECK(!broker->publish("undeclared", MsgPtr<int>(new Msg<int>(1))));
+	CHECK(!broker->subscribe<int>("undeclared", [](const MsgPtr<int>) {}));
+	//park the only worker so nothing drains "tight" meanwhile
+	std::atomic<bool> entered(false), release(false);
+	CHECK(broker->subscribe<int>("batched", [&](const MsgPtr<int>) {
+		entered = true;
+		while (!release)
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}));
+	CHECK(broker->publish("batched", MsgPtr<int>(new Msg<int>(7))));
+	auto give_up = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+	while (!entered && std::chrono::steady_clock::now() < give_up)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	CHECK(entered.load());
+	//a one-byte budget admits a single message into the empty queue, drop_newest refuses the rest
+	for (int i = 0; i < 3; ++i)
+		broker->publish("tight", MsgPtr<int>(new Msg<int>(i)));
+	CHECK(broker->stats("tight").queued == 1);
+	CHECK(broker->stats("tight").dropped == 2);
+	release = true;
+	pool->stop();
+}
+
+static MsgPtr<int> dueAt(int value, int64_t deadline, int priority = 0)
+{
+	MsgPtr<int> msg(new Msg<int>(value, priority));
+	msg->setdeadline(deadline);
+	return msg;
+}
+
+//earliest deadline first; messages without a deadline go last, by priority then FIFO
+TEST(edfOrdersByDeadline)
+{
+	EdfMsgQueue queue;
+	int64_t base = queue.now() + 60000000;
+	CHECK(queue.enqueue(dueAt(1, 0)));
+	CHECK(queue.enqueue(dueAt(2, base + 30)));
+	CHECK(queue.enqueue(dueAt(3, 0, 5)));
+	CHECK(queue.enqueue(dueAt(4, base + 10)));
+	CHECK(queue.enqueue(dueAt(5, base + 20)));
+	CHECK(queue.enqueue(dueAt(6, 0)));
+	std::vector<int> order;
+	while (BaseMsgPtr msg = queue.dequeue())
+		order.push_back(intOf(msg));
+	CHECK(order == std::vector<int>({4, 5, 2, 3, 1, 6}));
+	CHECK(queue.missed() == 0);
+}
+
+//messages dequeued past their deadline count in missed(); drop_missed also discards them
+TEST(edfCountsAndDropsMissed)
+{
+	for (int drop = 0; drop < 2; ++drop)
+	{
+		EdfMsgQueue queue(drop != 0);
+		int64_t t = queue.now();
+		CHECK(queue.enqueue(dueAt(1, t + 1)));
+		CHECK(queue.enqueue(dueAt(2, t + 60000000)));
+		CHECK(queue.enqueue(dueAt(3, t + 2)));
+		CHECK(queue.enqueue(dueAt(4, 0)));
+		std::this_thread::sleep_for(std::chrono::milliseconds(5));
+		std::vector<int> order;
+		while (BaseMsgPtr msg = queue.dequeue())
+			order.push_back(intOf(msg));
+		CHECK(queue.missed() == 2);
+		if (drop)
+		{
+			CHECK(order == std::vector<int>({2, 4}));
+			CHECK(queue.dropped() == 2);
+		}
+		else
+		{
+			CHECK(order == std::vector<int>({1, 3, 2, 4}));
+			CHECK(queue.dropped() == 0);
+		}
+		CHECK(queue.usedBytes() == 0);
+	}
+}
+
+//a deadline topic from a config reports misses in TopicStats and skips them with drop_missed
+TEST(deadlineTopicStats)
+{
+	BrokerConfig config;
+	TopicConfig topic("due");
+	topic.queue = QueueKind::Deadline;
+	topic.drop_missed = true;
+	config.topics.push_back(topic);
+	ThreadSafeMsgQueuePtr broker = ThreadSafeMsgQueue::create();
+	CHECK(broker->configure(config));
+	std::vector<int> got;
+	broker->subscribe<int>("due", [&](const MsgPtr<int> msg) { got.push_back(msg->getContentRef()); });
+	int64_t t = EdfMsgQueue::now();
+	CHECK(broker->publish("due", dueAt(1, t + 60000000)));
+	CHECK(broker->publish("due", dueAt(2, t + 1)));
+	CHECK(broker->publish("due", dueAt(3, t + 30000000)));
+	std::this_thread::sleep_for(std::chrono::milliseconds(5));
+	drain(broker);
+	CHECK(got == std::vector<int>({3, 1}));
+	CHECK(broker->stats("due").deadline_missed == 1);
+	CHECK(broker->stats("due").dropped == 1);
+}
+
+//a handle cancels or rewrites a message published through the broker until it is dispatched
+TEST(brokerCancelAndReplace)
+{
+	ThreadSafeMsgQueuePtr broker = ThreadSafeMsgQueue::create();
+	std::vector<int> got;
+	broker->subscribe<int>("edits", [&](const MsgPtr<int> msg) { got.push_back(msg->getContentRef()); });
+	MsgHandle<int> first, second, third;
+	CHECK(broker->publish("edits", MsgPtr<int>(new Msg<int>(1)), first));
+	CHECK(broker->publish("edits", MsgPtr<int>(new Msg<int>(2)), second));
+	CHECK(broker->publish("edits", MsgPtr<int>(new Msg<int>(3)), third));
+	CHECK(second.pending());
+	CHECK(second.cancel());
+	CHECK(!second.pending());
+	CHECK(third.replace(30));
+	drain(broker);
+	CHECK(got == std::vector<int>({1, 30}));
+	CHECK(broker->stats("edits").cancelled == 1);
+	CHECK(broker->stats("edits").dispatched == 2);
+	//once dispatched the message can no longer change
+	CHECK(!first.pending());
+	CHECK(!first.cancel());
+	CHECK(!third.replace(300));
+	CHECK(got == std::vector<int>({1, 30}));
+}